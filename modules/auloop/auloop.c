@@ -3,8 +3,11 @@
  *
  * Copyright (C) 2010 - 2015 Alfred E. Heggestad
  */
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <re.h>
+#include <re_atomic.h>
 #include <rem.h>
 #include <baresip.h>
 
@@ -18,10 +21,21 @@
  * so that a local loopback audio can be heard. Different audio parameters
  * can be tested, such as sampling rate and number of channels.
  *
+ * With the optional "latency" flag timestamped marker patterns are
+ * injected into the source frames and detected again at the player side.
+ * The summary then reports p50/p95/p99 source-to-player latency and a
+ * jitter histogram. Marker detection needs a bit-transparent S16LE path.
+ *
+ * The sweep command runs the latency measurement over a fixed list of
+ * samplerate/channel combinations and appends one CSV line per run to
+ * auloop_sweep.csv in the config path, for regression tracking across
+ * driver versions.
+ *
  * The following commands are available:
  \verbatim
- /auloop <samplerate> <channels>    Start audio-loop
- /auloop_stop                       Stop audio-loop
+ /auloop <samplerate> <channels> [latency]   Start audio-loop
+ /auloop_stop                                Stop audio-loop
+ /auloop_sweep                               Run sweep with CSV report
  \endverbatim
  */
 
@@ -30,6 +44,21 @@
 #define PTIME 20
 
 
+enum {
+	MARKER_LEN      = 6,      /* samples: 2 magic + 4 timestamp      */
+	MARKER_INTERVAL = 5,      /* source frames between markers       */
+	LAT_MAXN        = 1024,   /* latency samples kept for summary    */
+	SWEEP_RUN_MS    = 4000,   /* duration of one sweep run           */
+};
+
+static const uint16_t marker_magic[2] = { 0x7e5a, 0x2b1c };
+
+/* Jitter histogram bucket limits [us] */
+static const uint64_t jit_limv[] = {
+	1000, 2000, 5000, 10000, 20000, 50000
+};
+
+
 /** Audio Loop */
 struct audio_loop {
 	struct aubuf *aubuf;
@@ -37,26 +66,183 @@ struct audio_loop {
 	struct ausrc_st *ausrc;
 	const struct auplay *ap;
 	struct auplay_st *auplay;
-	mtx_t *mtx;
 	struct tmr tmr;
 	uint32_t srate;
 	uint8_t ch;
 	enum aufmt fmt;
 	bool started;
+	bool measure;
 
 	size_t aubuf_maxsz;
-	uint64_t aubuf_overrun;
-	uint64_t aubuf_underrun;
+	RE_ATOMIC uint64_t aubuf_overrun;
+	RE_ATOMIC uint64_t aubuf_underrun;
 
+	/* Updated with relaxed atomics so the audio driver callbacks
+	 * never block on the periodic display handler */
 	struct stats {
-		uint64_t n_samp;
-		uint64_t n_frames;
+		RE_ATOMIC uint64_t n_samp;
+		RE_ATOMIC uint64_t n_frames;
 	} stats_src, stats_play;
+
+	uint32_t mark_cnt;        /**< Source frames since last marker   */
+	struct latstats {
+		uint64_t latv[LAT_MAXN];            /**< Ring buffer [us] */
+		size_t latc;                        /**< Total recorded   */
+		uint64_t last;                      /**< Previous latency */
+		uint64_t lat_min;
+		uint64_t lat_max;
+		uint64_t lat_sum;
+		uint64_t jitv[RE_ARRAY_SIZE(jit_limv) + 1];
+		uint64_t n_marks;                   /**< Markers injected */
+	} lat;
 };
 
 
 static struct audio_loop *gal = NULL;
 
+/** Samplerate/channel combinations covered by the sweep */
+static const struct {
+	uint32_t srate;
+	uint8_t ch;
+} sweepv[] = {
+	{ 8000, 1},
+	{16000, 1},
+	{32000, 1},
+	{48000, 1},
+	{48000, 2},
+};
+
+static struct {
+	struct tmr tmr;
+	size_t idx;
+	bool active;
+	char path[256];
+} sweep;
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+/**
+ * Calculate a latency percentile from the recorded samples
+ *
+ * @param lat Latency statistics
+ * @param p   Percentile (0-100)
+ *
+ * @return Latency in [us]
+ */
+static uint64_t lat_percentile(const struct latstats *lat, unsigned p)
+{
+	uint64_t sortv[LAT_MAXN];
+	size_t n = min(lat->latc, (size_t)LAT_MAXN);
+
+	if (!n)
+		return 0;
+
+	memcpy(sortv, lat->latv, n * sizeof(uint64_t));
+	qsort(sortv, n, sizeof(uint64_t), cmp_u64);
+
+	return sortv[min(n * p / 100, n - 1)];
+}
+
+
+static void latency_record(struct audio_loop *al, uint64_t lat)
+{
+	struct latstats *ls = &al->lat;
+	uint64_t jit;
+	size_t i;
+
+	ls->latv[ls->latc % LAT_MAXN] = lat;
+
+	if (!ls->latc || lat < ls->lat_min)
+		ls->lat_min = lat;
+
+	if (lat > ls->lat_max)
+		ls->lat_max = lat;
+
+	ls->lat_sum += lat;
+
+	if (ls->latc) {
+		jit = lat > ls->last ? lat - ls->last : ls->last - lat;
+
+		for (i = 0; i < RE_ARRAY_SIZE(jit_limv); i++) {
+			if (jit <= jit_limv[i])
+				break;
+		}
+
+		++ls->jitv[i];
+	}
+
+	ls->last = lat;
+	++ls->latc;
+}
+
+
+static void marker_scan(struct audio_loop *al, const int16_t *sampv,
+			size_t sampc)
+{
+	size_t i;
+
+	for (i = 0; i + MARKER_LEN <= sampc; i++) {
+		uint64_t ts, now;
+		size_t k;
+
+		if ((uint16_t)sampv[i]     != marker_magic[0] ||
+		    (uint16_t)sampv[i + 1] != marker_magic[1])
+			continue;
+
+		ts = 0;
+		for (k = 0; k < 4; k++)
+			ts |= (uint64_t)(uint16_t)sampv[i + 2 + k] << (16*k);
+
+		now = tmr_jiffies_usec();
+		if (now >= ts)
+			latency_record(al, now - ts);
+
+		i += MARKER_LEN - 1;
+	}
+}
+
+
+static int print_latency(struct re_printf *pf, const struct audio_loop *al)
+{
+	const struct latstats *ls = &al->lat;
+	size_t i;
+	int err;
+
+	err = re_hprintf(pf,
+			 "* Latency\n"
+			 "  markers     %llu sent, %zu detected\n"
+			 "  min/avg/max %.2f/%.2f/%.2f ms\n"
+			 "  p50/p95/p99 %.2f/%.2f/%.2f ms\n"
+			 "  jitter histogram:\n"
+			 ,
+			 ls->n_marks, ls->latc,
+			 ls->lat_min / 1000.0,
+			 (double)ls->lat_sum / (double)ls->latc / 1000.0,
+			 ls->lat_max / 1000.0,
+			 lat_percentile(ls, 50) / 1000.0,
+			 lat_percentile(ls, 95) / 1000.0,
+			 lat_percentile(ls, 99) / 1000.0);
+
+	for (i = 0; i < RE_ARRAY_SIZE(jit_limv); i++) {
+		err |= re_hprintf(pf, "    <= %2llu ms  %llu\n",
+				  jit_limv[i] / 1000, ls->jitv[i]);
+	}
+
+	err |= re_hprintf(pf, "     > %2llu ms  %llu\n\n",
+			  jit_limv[RE_ARRAY_SIZE(jit_limv) - 1] / 1000,
+			  ls->jitv[RE_ARRAY_SIZE(jit_limv)]);
+
+	return err;
+}
+
 
 static int print_summary(struct re_printf *pf, struct audio_loop *al)
 {
@@ -71,12 +257,15 @@ static int print_summary(struct re_printf *pf, struct audio_loop *al)
 	if (al->ausrc) {
 		const struct ausrc *as = al->as;
 		const char *name = as->name;
-		const struct stats *stats = &al->stats_src;
+		uint64_t n_samp, n_frames;
 		double dur;
 
 		al->ausrc = mem_deref(al->ausrc);
 
-		dur = (double)stats->n_samp / scale;
+		n_samp   = re_atomic_rlx(&al->stats_src.n_samp);
+		n_frames = re_atomic_rlx(&al->stats_src.n_frames);
+
+		dur = (double)n_samp / scale;
 
 		err |= re_hprintf(pf,
 				  "* Source\n"
@@ -87,10 +276,10 @@ static int print_summary(struct re_printf *pf, struct audio_loop *al)
 				  "\n"
 				  ,
 				  name,
-				  stats->n_samp,
+				  n_samp,
 				  dur,
-				  al->stats_src.n_frames,
-				  1000.0*dur / (double)al->stats_src.n_frames
+				  n_frames,
+				  1000.0*dur / (double)n_frames
 				  );
 	}
 
@@ -102,21 +291,27 @@ static int print_summary(struct re_printf *pf, struct audio_loop *al)
 				  "  underrun    %llu\n"
 				  "\n"
 				  ,
-				  al->aubuf_overrun,
-				  al->aubuf_underrun);
+				  re_atomic_rlx(&al->aubuf_overrun),
+				  re_atomic_rlx(&al->aubuf_underrun));
 	}
 
+	if (al->measure && al->lat.latc)
+		err |= print_latency(pf, al);
+
 	/* Player */
 	if (al->auplay) {
 		const struct auplay *ap = al->ap;
 		const char *name = ap->name;
-		const struct stats *stats = &al->stats_play;
+		uint64_t n_samp, n_frames;
 		double dur;
 
 		/* stop device first */
 		al->auplay = mem_deref(al->auplay);
 
-		dur = (double)stats->n_samp / scale;
+		n_samp   = re_atomic_rlx(&al->stats_play.n_samp);
+		n_frames = re_atomic_rlx(&al->stats_play.n_frames);
+
+		dur = (double)n_samp / scale;
 
 		err |= re_hprintf(pf,
 				  "* Player\n"
@@ -127,10 +322,10 @@ static int print_summary(struct re_printf *pf, struct audio_loop *al)
 				  "\n"
 				  ,
 				  name,
-				  stats->n_samp,
+				  n_samp,
 				  dur,
-				  stats->n_frames,
-				  1000.0*dur / (double)stats->n_frames
+				  n_frames,
+				  1000.0*dur / (double)n_frames
 				  );
 	}
 
@@ -149,35 +344,32 @@ static void auloop_destructor(void *arg)
 	mem_deref(al->ausrc);
 	mem_deref(al->auplay);
 	mem_deref(al->aubuf);
-	mem_deref(al->mtx);
 }
 
 
 static void print_stats(struct audio_loop *al)
 {
-	double rw_ratio = 0.0;
-	double delay;
 	const double scale = al->srate * al->ch;
+	const uint64_t n_read  = re_atomic_rlx(&al->stats_src.n_samp);
+	const uint64_t n_write = re_atomic_rlx(&al->stats_play.n_samp);
+	double rw_ratio;
+	double delay;
 
-	mtx_lock(al->mtx);
-
-	delay = (double)al->stats_src.n_samp - (double)al->stats_play.n_samp;
+	delay = (double)n_read - (double)n_write;
 
-	rw_ratio = (double)al->stats_src.n_samp/(double)al->stats_play.n_samp;
+	rw_ratio = (double)n_read / (double)n_write;
 
 	(void)re_fprintf(stdout, "\r%uHz %dch %s "
 			 " n_read=%.3f n_write=%.3f rw_delay=%.3f [sec]"
 			 " rw_ratio=%f"
 			 ,
 			 al->srate, al->ch, aufmt_name(al->fmt),
-			 (double)al->stats_src.n_samp / scale,
-			 (double)al->stats_play.n_samp / scale,
+			 (double)n_read / scale,
+			 (double)n_write / scale,
 			 delay / scale, rw_ratio);
 
 	(void)re_fprintf(stdout, "          \r");
 
-	mtx_unlock(al->mtx);
-
 	fflush(stdout);
 }
 
@@ -203,16 +395,28 @@ static void src_read_handler(struct auframe *af, void *arg)
 		return;
 	}
 
-	mtx_lock(al->mtx);
+	re_atomic_rlx_add(&stats->n_samp, af->sampc);
+	re_atomic_rlx_add(&stats->n_frames, 1);
 
-	stats->n_samp   += af->sampc;
-	stats->n_frames += 1;
+	if (aubuf_cur_size(al->aubuf) >= al->aubuf_maxsz)
+		re_atomic_rlx_add(&al->aubuf_overrun, 1);
 
-	if (aubuf_cur_size(al->aubuf) >= al->aubuf_maxsz) {
-		++al->aubuf_overrun;
-	}
+	if (al->measure && al->fmt == AUFMT_S16LE &&
+	    af->sampc >= MARKER_LEN &&
+	    ++al->mark_cnt >= MARKER_INTERVAL) {
 
-	mtx_unlock(al->mtx);
+		int16_t *s = af->sampv;
+		uint64_t ts = tmr_jiffies_usec();
+		size_t k;
+
+		al->mark_cnt = 0;
+		s[0] = (int16_t)marker_magic[0];
+		s[1] = (int16_t)marker_magic[1];
+		for (k = 0; k < 4; k++)
+			s[2 + k] = (int16_t)(uint16_t)(ts >> (16*k));
+
+		++al->lat.n_marks;
+	}
 
 	err = aubuf_write(al->aubuf, af->sampv, auframe_size(af));
 	if (err) {
@@ -232,19 +436,18 @@ static void write_handler(struct auframe *af, void *arg)
 			aufmt_name(al->fmt), aufmt_name(af->fmt));
 	}
 
-	mtx_lock(al->mtx);
-
-	stats->n_samp   += af->sampc;
-	stats->n_frames += 1;
+	re_atomic_rlx_add(&stats->n_samp, af->sampc);
+	re_atomic_rlx_add(&stats->n_frames, 1);
 
-	if (stats->n_samp && aubuf_cur_size(al->aubuf) < num_bytes) {
-		++al->aubuf_underrun;
-	}
-
-	mtx_unlock(al->mtx);
+	if (re_atomic_rlx(&stats->n_samp) &&
+	    aubuf_cur_size(al->aubuf) < num_bytes)
+		re_atomic_rlx_add(&al->aubuf_underrun, 1);
 
 	/* read from beginning */
 	aubuf_read(al->aubuf, af->sampv, num_bytes);
+
+	if (al->measure && af->fmt == AUFMT_S16LE)
+		marker_scan(al, af->sampv, af->sampc);
 }
 
 
@@ -334,7 +537,7 @@ static int auloop_reset(struct audio_loop *al, uint32_t srate, uint8_t ch)
 
 
 static int audio_loop_alloc(struct audio_loop **alp,
-			    uint32_t srate, uint8_t ch)
+			    uint32_t srate, uint8_t ch, bool measure)
 {
 	struct audio_loop *al;
 	int err;
@@ -343,9 +546,7 @@ static int audio_loop_alloc(struct audio_loop **alp,
 	if (!al)
 		return ENOMEM;
 
-	err = mutex_alloc(&al->mtx);
-	if (err)
-		goto out;
+	al->measure = measure;
 
 	tmr_start(&al->tmr, 100, tmr_handler, al);
 
@@ -353,6 +554,11 @@ static int audio_loop_alloc(struct audio_loop **alp,
 	if (err)
 		goto out;
 
+	if (measure && al->fmt != AUFMT_S16LE) {
+		warning("auloop: latency measurement needs AUFMT_S16LE\n");
+		al->measure = false;
+	}
+
 	al->started = true;
 
  out:
@@ -365,25 +571,94 @@ static int audio_loop_alloc(struct audio_loop **alp,
 }
 
 
+static void sweep_csv_append(struct audio_loop *al)
+{
+	FILE *f;
+
+	f = fopen(sweep.path, "a");
+	if (!f) {
+		warning("auloop: sweep: could not open %s\n", sweep.path);
+		return;
+	}
+
+	if (ftell(f) == 0)
+		(void)fprintf(f, "srate,ch,fmt,frames_src,frames_play,"
+			      "overrun,underrun,markers,detected,"
+			      "lat_p50_us,lat_p95_us,lat_p99_us,"
+			      "lat_min_us,lat_max_us\n");
+
+	(void)fprintf(f, "%u,%u,%s,%llu,%llu,%llu,%llu,%llu,%zu,"
+		      "%llu,%llu,%llu,%llu,%llu\n",
+		      al->srate, al->ch, aufmt_name(al->fmt),
+		      (unsigned long long)
+				re_atomic_rlx(&al->stats_src.n_frames),
+		      (unsigned long long)
+				re_atomic_rlx(&al->stats_play.n_frames),
+		      (unsigned long long)re_atomic_rlx(&al->aubuf_overrun),
+		      (unsigned long long)re_atomic_rlx(&al->aubuf_underrun),
+		      (unsigned long long)al->lat.n_marks,
+		      al->lat.latc,
+		      (unsigned long long)lat_percentile(&al->lat, 50),
+		      (unsigned long long)lat_percentile(&al->lat, 95),
+		      (unsigned long long)lat_percentile(&al->lat, 99),
+		      (unsigned long long)(al->lat.latc ?
+					   al->lat.lat_min : 0),
+		      (unsigned long long)al->lat.lat_max);
+
+	(void)fclose(f);
+}
+
+
+static void sweep_handler(void *arg)
+{
+	int err;
+	(void)arg;
+
+	if (gal) {
+		sweep_csv_append(gal);
+		gal = mem_deref(gal);
+	}
+
+	if (sweep.idx >= RE_ARRAY_SIZE(sweepv)) {
+		info("auloop: sweep done, results in %s\n", sweep.path);
+		sweep.active = false;
+		return;
+	}
+
+	err = audio_loop_alloc(&gal, sweepv[sweep.idx].srate,
+			       sweepv[sweep.idx].ch, true);
+	if (err) {
+		warning("auloop: sweep: alloc failed %m\n", err);
+		sweep.active = false;
+		return;
+	}
+
+	++sweep.idx;
+	tmr_start(&sweep.tmr, SWEEP_RUN_MS, sweep_handler, NULL);
+}
+
+
 /*
  * Start the audio loop (for testing)
  */
 static int auloop_start(struct re_printf *pf, void *arg)
 {
 	struct cmd_arg *carg = arg;
-	struct pl pl_srate, pl_ch;
+	struct pl pl_srate, pl_ch, pl_opt = PL_INIT;
 	uint32_t srate, ch;
 	int err;
 
-	if (gal)
+	if (gal || sweep.active)
 		return re_hprintf(pf, "audio-loop already running.\n");
 
-	err = re_regex(carg->prm, str_len(carg->prm), "[0-9]+ [0-9]+",
-		       &pl_srate, &pl_ch);
+	err = re_regex(carg->prm, str_len(carg->prm),
+		       "[0-9]+ [0-9]+[ ]*[^ ]*",
+		       &pl_srate, &pl_ch, NULL, &pl_opt);
 	if (err) {
 		return re_hprintf(pf,
 				  "Usage:"
-				  " /auloop <samplerate> <channels>\n");
+				  " /auloop <samplerate> <channels>"
+				  " [latency]\n");
 	}
 
 	srate = pl_u32(&pl_srate);
@@ -391,7 +666,8 @@ static int auloop_start(struct re_printf *pf, void *arg)
 	if (!srate || !ch)
 		return re_hprintf(pf, "invalid samplerate or channels\n");
 
-	err = audio_loop_alloc(&gal, srate, (uint8_t)ch);
+	err = audio_loop_alloc(&gal, srate, (uint8_t)ch,
+			       !pl_strcmp(&pl_opt, "latency"));
 	if (err) {
 		warning("auloop: alloc failed %m\n", err);
 	}
@@ -400,10 +676,44 @@ static int auloop_start(struct re_printf *pf, void *arg)
 }
 
 
+static int auloop_sweep(struct re_printf *pf, void *arg)
+{
+	char path[256];
+	int err;
+	(void)arg;
+
+	if (gal || sweep.active)
+		return re_hprintf(pf, "audio-loop already running.\n");
+
+	err = conf_path_get(path, sizeof(path));
+	if (err)
+		return err;
+
+	if (re_snprintf(sweep.path, sizeof(sweep.path),
+			"%s/auloop_sweep.csv", path) < 0)
+		return ENOMEM;
+
+	sweep.idx = 0;
+	sweep.active = true;
+
+	(void)re_hprintf(pf, "audio-loop sweep started (%zu runs)\n",
+			 RE_ARRAY_SIZE(sweepv));
+
+	tmr_start(&sweep.tmr, 0, sweep_handler, NULL);
+	return 0;
+}
+
+
 static int auloop_stop(struct re_printf *pf, void *arg)
 {
 	(void)arg;
 
+	if (sweep.active) {
+		tmr_cancel(&sweep.tmr);
+		sweep.active = false;
+		(void)re_hprintf(pf, "audio-loop sweep stopped\n");
+	}
+
 	if (gal) {
 		(void)re_hprintf(pf, "audio-loop stopped\n");
 		gal = mem_deref(gal);
@@ -414,8 +724,11 @@ static int auloop_stop(struct re_printf *pf, void *arg)
 
 
 static const struct cmd cmdv[] = {
-	{"auloop",     0,CMD_PRM, "Start audio-loop <srate ch>", auloop_start},
+	{"auloop",     0,CMD_PRM, "Start audio-loop <srate ch> [latency]",
+								 auloop_start},
 	{"auloop_stop",0,0,       "Stop audio-loop",             auloop_stop },
+	{"auloop_sweep",0,0,      "Run audio-loop sweep with CSV report",
+								 auloop_sweep},
 };
 
 
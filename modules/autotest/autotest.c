@@ -11,6 +11,16 @@
  * On host B with IP 10.1.0.215:
  * /autohangupdelay 2000
  *
+ * The module also provides a call load generator with N concurrent
+ * channels and a target call-setup rate:
+ *
+ * /autoload sip:b@10.1.0.215 20 5 30
+ *
+ * dials up to 20 concurrent calls at 5 calls/s, ramping the rate up
+ * linearly over 30 s. /autoloadstop stops the generator and prints a
+ * summary with setup-time percentiles, failure counts and the
+ * achieved rate.
+ *
  * Copyright (C) 2021 Commend.com - c.spielberger@commend.com
  */
 
@@ -19,6 +29,12 @@
 #include <re.h>
 #include <baresip.h>
 
+enum {
+	LOAD_TICK_MS  = 100,          /* generator pacing tick             */
+	LOAD_MAXN     = 512,          /* setup-time samples kept           */
+	LOAD_HOLD_MS  = 2000,         /* default hold time per call        */
+};
+
 struct autotest {
 	struct mbuf *mbdial;          /**< Dial command                      */
 	struct mbuf *mbhangup;        /**< Hangup command                    */
@@ -32,8 +48,39 @@ struct autotest {
 };
 
 
+/** Call channel of the load generator */
+struct loadcall {
+	struct le le;
+	struct call *call;
+	struct tmr tmr_bye;           /**< Hold timer until hangup           */
+	uint64_t ts_dial;
+	uint64_t ts_estab;
+};
+
+
 static struct autotest d;
 
+/** Load generator state */
+static struct {
+	bool active;
+	char *uri;                    /**< Target URI                        */
+	uint32_t nchan;               /**< Max concurrent calls              */
+	uint32_t rate;                /**< Target setup rate [calls/s]       */
+	uint32_t ramp_ms;             /**< Linear rate ramp-up               */
+	uint32_t hold_ms;             /**< Hold time before hangup           */
+	uint64_t ts_start;
+	uint64_t last_tick;
+	double credit;                /**< Accumulated dial credit           */
+	struct tmr tmr_tick;
+	struct list calll;            /**< Active struct loadcall pool       */
+	uint32_t n_active;
+	uint64_t n_dialed;
+	uint64_t n_estab;
+	uint64_t n_failed;
+	uint64_t latv[LOAD_MAXN];     /**< Setup times ring [ms]             */
+	size_t latc;
+} gen;
+
 
 static int response_print(const char *p, size_t size, void *arg)
 {
@@ -93,6 +140,200 @@ static void dial(void *arg)
 }
 
 
+static void loadcall_destructor(void *arg)
+{
+	struct loadcall *lc = arg;
+
+	tmr_cancel(&lc->tmr_bye);
+	list_unlink(&lc->le);
+}
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+static uint64_t setup_percentile(unsigned p)
+{
+	uint64_t sortv[LOAD_MAXN];
+	size_t n = min(gen.latc, (size_t)LOAD_MAXN);
+
+	if (!n)
+		return 0;
+
+	memcpy(sortv, gen.latv, n * sizeof(uint64_t));
+	qsort(sortv, n, sizeof(uint64_t), cmp_u64);
+
+	return sortv[min(n * p / 100, n - 1)];
+}
+
+
+static struct loadcall *load_find(const struct call *call)
+{
+	struct le *le;
+
+	LIST_FOREACH(&gen.calll, le) {
+		struct loadcall *lc = le->data;
+
+		if (lc->call == call)
+			return lc;
+	}
+
+	return NULL;
+}
+
+
+static void load_bye(void *arg)
+{
+	struct loadcall *lc = arg;
+
+	(void)ua_hangup(call_get_ua(lc->call), lc->call, 0, NULL);
+}
+
+
+static void load_dial(void)
+{
+	struct loadcall *lc;
+	struct ua *ua;
+	int err;
+
+	ua = uag_find_requri(gen.uri);
+	if (!ua) {
+		++gen.n_failed;
+		return;
+	}
+
+	lc = mem_zalloc(sizeof(*lc), loadcall_destructor);
+	if (!lc)
+		return;
+
+	lc->ts_dial = tmr_jiffies();
+	err = ua_connect(ua, &lc->call, NULL, gen.uri, VIDMODE_OFF);
+	if (err) {
+		warning("autotest: load dial failed (%m)\n", err);
+		++gen.n_failed;
+		mem_deref(lc);
+		return;
+	}
+
+	++gen.n_dialed;
+	++gen.n_active;
+	list_append(&gen.calll, &lc->le, lc);
+}
+
+
+static void load_tick(void *arg)
+{
+	const uint64_t now = tmr_jiffies();
+	double rate = gen.rate;
+	uint32_t burst = 0;
+	(void)arg;
+
+	tmr_start(&gen.tmr_tick, LOAD_TICK_MS, load_tick, NULL);
+
+	if (gen.ramp_ms && now - gen.ts_start < gen.ramp_ms)
+		rate = rate * (double)(now - gen.ts_start) /
+			(double)gen.ramp_ms;
+
+	if (gen.rate) {
+		gen.credit += rate * (double)(now - gen.last_tick) / 1000.0;
+		if (gen.credit > (double)gen.nchan)
+			gen.credit = (double)gen.nchan;
+	}
+
+	gen.last_tick = now;
+
+	while (gen.n_active < gen.nchan && burst++ < gen.nchan &&
+	       (!gen.rate || gen.credit >= 1.0)) {
+
+		if (gen.rate)
+			gen.credit -= 1.0;
+
+		load_dial();
+	}
+}
+
+
+static void load_event(enum ua_event ev, struct call *call)
+{
+	struct loadcall *lc;
+
+	if (!gen.active || !call)
+		return;
+
+	lc = load_find(call);
+	if (!lc)
+		return;
+
+	switch (ev) {
+
+	case UA_EVENT_CALL_ESTABLISHED:
+		if (lc->ts_estab)
+			break;
+
+		lc->ts_estab = tmr_jiffies();
+		gen.latv[gen.latc++ % LOAD_MAXN] = lc->ts_estab -
+						   lc->ts_dial;
+		++gen.n_estab;
+		tmr_start(&lc->tmr_bye, gen.hold_ms, load_bye, lc);
+		break;
+
+	case UA_EVENT_CALL_CLOSED:
+		if (!lc->ts_estab)
+			++gen.n_failed;
+
+		--gen.n_active;
+		mem_deref(lc);
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+static int load_summary(struct re_printf *pf)
+{
+	const double dur = (double)(tmr_jiffies() - gen.ts_start) / 1000.0;
+	int err;
+
+	err  = re_hprintf(pf, "~~~~~ Load generator summary: ~~~~~\n");
+	err |= re_hprintf(pf,
+			  "  target      %s\n"
+			  "  channels    %u (%u active)\n"
+			  "  rate        %u calls/s (ramp %u s,"
+			  " hold %u ms)\n"
+			  "  duration    %.1f sec\n"
+			  "  dialed      %llu\n"
+			  "  established %llu (achieved %.2f calls/s)\n"
+			  "  failed      %llu\n"
+			  ,
+			  gen.uri,
+			  gen.nchan, gen.n_active,
+			  gen.rate, gen.ramp_ms / 1000, gen.hold_ms,
+			  dur,
+			  gen.n_dialed,
+			  gen.n_estab,
+			  dur > 0.0 ? (double)gen.n_estab / dur : 0.0,
+			  gen.n_failed);
+
+	if (gen.latc)
+		err |= re_hprintf(pf,
+				  "  setup time  p50=%llu ms p95=%llu ms"
+				  " p99=%llu ms\n",
+				  setup_percentile(50),
+				  setup_percentile(95),
+				  setup_percentile(99));
+
+	return err;
+}
+
+
 static void event_handler(enum ua_event ev, struct bevent *event, void *arg)
 {
 	struct ua   *ua   = bevent_get_ua(event);
@@ -104,6 +345,8 @@ static void event_handler(enum ua_event ev, struct bevent *event, void *arg)
 	info("autotest: [ ua=%s call=%s ] event: %s (%s)\n",
 	      account_aor(acc), call_id(call), uag_event_str(ev), txt);
 
+	load_event(ev, call);
+
 	switch (ev) {
 
 	case UA_EVENT_CALL_INCOMING:
@@ -269,6 +512,97 @@ static int cmd_stat(struct re_printf *pf, void *arg)
 }
 
 
+static int cmd_autoload(struct re_printf *pf, void *arg)
+{
+	const struct cmd_arg *carg = arg;
+	struct pl uri, chan, rate, ramp = PL_INIT, hold = PL_INIT;
+	int err;
+	const char *usage = "Usage:\n  autoload <uri> <channels>"
+			" <rate calls/s, 0=max> [ramp-up s] [hold ms]\n";
+
+	if (gen.active)
+		return re_hprintf(pf,
+				  "autotest: load generator already"
+				  " running\n");
+
+	err = re_regex(carg->prm, str_len(carg->prm),
+		       "[^ ]+ [0-9]+ [0-9]+[ ]*[0-9]*[ ]*[0-9]*",
+		       &uri, &chan, &rate, NULL, &ramp, NULL, &hold);
+	if (err) {
+		re_hprintf(pf, usage);
+		return EINVAL;
+	}
+
+	if (!pl_u32(&chan)) {
+		re_hprintf(pf, usage);
+		return EINVAL;
+	}
+
+	gen.uri = mem_deref(gen.uri);
+	err = pl_strdup(&gen.uri, &uri);
+	if (err)
+		return err;
+
+	gen.nchan    = pl_u32(&chan);
+	gen.rate     = pl_u32(&rate);
+	gen.ramp_ms  = pl_isset(&ramp) ? pl_u32(&ramp) * 1000 : 0;
+	gen.hold_ms  = pl_isset(&hold) ? pl_u32(&hold) : LOAD_HOLD_MS;
+	gen.ts_start = gen.last_tick = tmr_jiffies();
+	gen.credit   = 0.0;
+	gen.n_active = 0;
+	gen.n_dialed = gen.n_estab = gen.n_failed = 0;
+	gen.latc     = 0;
+	gen.active   = true;
+
+	tmr_start(&gen.tmr_tick, LOAD_TICK_MS, load_tick, NULL);
+
+	return re_hprintf(pf, "autotest: load generator started:"
+			  " %s, %u channels, %u calls/s\n",
+			  gen.uri, gen.nchan, gen.rate);
+}
+
+
+static int cmd_autoload_stop(struct re_printf *pf, void *arg)
+{
+	struct le *le;
+	int err;
+	(void)arg;
+
+	if (!gen.active)
+		return re_hprintf(pf, "autotest: load generator not"
+				  " running\n");
+
+	/* stop first so closed events do not touch the pool */
+	gen.active = false;
+	tmr_cancel(&gen.tmr_tick);
+
+	err = load_summary(pf);
+
+	LIST_FOREACH(&gen.calll, le) {
+		struct loadcall *lc = le->data;
+
+		(void)ua_hangup(call_get_ua(lc->call), lc->call, 0, NULL);
+	}
+
+	list_flush(&gen.calll);
+	gen.n_active = 0;
+
+	return err;
+}
+
+
+static int cmd_autoload_stat(struct re_printf *pf, void *arg)
+{
+	(void)arg;
+
+	if (!gen.active)
+		return re_hprintf(pf, "autotest: load generator not"
+				  " running\n");
+
+	return load_summary(pf);
+}
+
+
 static const struct cmd cmdv[] = {
 
 {"autodial", 0, CMD_PRM, "Set auto dial command", cmd_autodial               },
@@ -280,6 +614,9 @@ static const struct cmd cmdv[] = {
 {"autodialcancel", 0, 0, "Cancel auto dial", cmd_autodial_cancel },
 {"autohangupcancel", 0, 0, "Cancel auto hangup", cmd_autohangup_cancel },
 {"autostat", 0, 0, "Print autotest status",  cmd_stat                        },
+{"autoload", 0, CMD_PRM, "Start call load generator", cmd_autoload           },
+{"autoloadstop", 0, 0, "Stop call load generator", cmd_autoload_stop         },
+{"autoloadstat", 0, 0, "Print load generator status", cmd_autoload_stat     },
 };
 
 
@@ -304,10 +641,14 @@ static int module_close(void)
 
 	tmr_cancel(&d.tmr_hangup);
 	tmr_cancel(&d.tmr_dial);
+	gen.active = false;
+	tmr_cancel(&gen.tmr_tick);
+	list_flush(&gen.calll);
 	cmd_unregister(baresip_commands(), cmdv);
 	bevent_unregister(event_handler);
 	mem_deref(d.mbdial);
 	mem_deref(d.mbhangup);
+	gen.uri = mem_deref(gen.uri);
 	return 0;
 }
 
@@ -19,15 +19,79 @@
  */
 
 
+enum {
+	HASH_SIZE      = 32,
+	SETUP_RATE_WIN = 16,   /* Sessions in the setup-rate window */
+};
+
 struct session {
 	struct le le;
+	struct le hle_in;       /**< Hash entry keyed by inbound call   */
+	struct le hle_out;      /**< Hash entry keyed by outbound call  */
+	struct le ile_in;       /**< Hash entry keyed by inbound id     */
+	struct le ile_out;      /**< Hash entry keyed by outbound id    */
 	struct call *call_in, *call_out;
+	uint64_t ts_start;      /**< Session creation time in [ms]      */
+	uint64_t lat;           /**< Bridge latency in [ms] (0=pending) */
+	bool relay;             /**< Both legs use the identical codec */
 };
 
 
 static struct list sessionl;
+static struct hash *sessh;      /* sessions keyed by call pointer */
+static struct hash *sessidh;    /* sessions keyed by SIP Call-ID  */
 static struct ua *ua_in, *ua_out;
 
+static uint64_t n_sess_total;
+static uint64_t n_bridged;
+static uint64_t lat_sum;
+static uint64_t lat_max;
+static uint64_t setup_tsv[SETUP_RATE_WIN];
+
+
+static uint32_t hash_ptr(const struct call *call)
+{
+	return hash_fast((const char *)&call, sizeof(call));
+}
+
+
+static bool lookup_call(struct le *le, void *arg)
+{
+	struct session *sess = le->data;
+
+	return sess->call_in == arg || sess->call_out == arg;
+}
+
+
+static bool lookup_id(struct le *le, void *arg)
+{
+	struct session *sess = le->data;
+	const char *id = arg;
+
+	return 0 == str_cmp(call_id(sess->call_in), id) ||
+	       0 == str_cmp(call_id(sess->call_out), id);
+}
+
+
+static struct session *session_lookup(const struct call *call)
+{
+	struct le *le;
+
+	le = hash_lookup(sessh, hash_ptr(call), lookup_call, (void *)call);
+
+	return le ? le->data : NULL;
+}
+
+
+static struct session *session_lookup_id(const char *id)
+{
+	struct le *le;
+
+	le = hash_lookup(sessidh, hash_fast_str(id), lookup_id, (void *)id);
+
+	return le ? le->data : NULL;
+}
+
 
 static struct call *other_call(struct session *sess, const struct call *call)
 {
@@ -46,11 +110,77 @@ static void destructor(void *arg)
 	      sess->call_in, sess->call_out);
 
 	list_unlink(&sess->le);
+	hash_unlink(&sess->hle_in);
+	hash_unlink(&sess->hle_out);
+	hash_unlink(&sess->ile_in);
+	hash_unlink(&sess->ile_out);
 	mem_deref(sess->call_out);
 	mem_deref(sess->call_in);
 }
 
 
+static const struct sdp_format *leg_rformat(const struct call *call)
+{
+	return sdp_media_rformat(stream_sdpmedia(audio_strm(
+				 call_audio(call))), NULL);
+}
+
+
+/*
+ * Pin the inbound answer to the codec the outbound leg negotiated
+ *
+ * Called when the outbound leg is established, before the inbound leg
+ * is answered. If the inbound offer contains the same codec, all other
+ * audio formats are dropped from the answer so that both legs end up
+ * on the identical codec and the bridge runs without resampling or
+ * cross-codec transcoding. On mismatch the answer is left untouched
+ * and the session falls back to transcoding.
+ */
+static void session_align_codecs(struct session *sess)
+{
+	const struct sdp_format *rfmt;
+	struct sdp_media *m;
+	struct le *le;
+
+	rfmt = leg_rformat(sess->call_out);
+	if (!rfmt)
+		return;
+
+	m = stream_sdpmedia(audio_strm(call_audio(sess->call_in)));
+	if (!sdp_media_format(m, false, NULL, -1, rfmt->name,
+			      rfmt->srate, rfmt->ch)) {
+		debug("b2bua: inbound leg does not offer %s/%u/%u,"
+		      " falling back to transcode\n",
+		      rfmt->name, rfmt->srate, rfmt->ch);
+		return;
+	}
+
+	for (le = list_head(sdp_media_format_lst(m, true)); le;
+	     le = le->next) {
+		struct sdp_format *fmt = le->data;
+
+		if (0 == str_casecmp(fmt->name, "telephone-event"))
+			continue;
+
+		fmt->sup = 0 == str_casecmp(fmt->name, rfmt->name) &&
+			fmt->srate == rfmt->srate && fmt->ch == rfmt->ch;
+	}
+}
+
+
+static bool session_codec_match(const struct session *sess)
+{
+	const struct sdp_format *in  = leg_rformat(sess->call_in);
+	const struct sdp_format *out = leg_rformat(sess->call_out);
+
+	if (!in || !out)
+		return false;
+
+	return 0 == str_casecmp(in->name, out->name) &&
+		in->srate == out->srate && in->ch == out->ch;
+}
+
+
 static void call_event_handler(struct call *call, enum call_event ev,
 			       const char *str, void *arg)
 {
@@ -62,8 +192,24 @@ static void call_event_handler(struct call *call, enum call_event ev,
 	case CALL_EVENT_ESTABLISHED:
 		debug("b2bua: CALL_ESTABLISHED: peer_uri=%s\n",
 		      call_peeruri(call));
+		if (call == sess->call_out)
+			session_align_codecs(sess);
+
 		call_answer(call2, 200,
 			    call_has_video(call) ? VIDMODE_ON : VIDMODE_OFF);
+
+		if (call == sess->call_in && !sess->lat) {
+			sess->relay = session_codec_match(sess);
+			sess->lat = tmr_jiffies() - sess->ts_start;
+			lat_sum += sess->lat;
+			if (sess->lat > lat_max)
+				lat_max = sess->lat;
+
+			++n_bridged;
+			debug("b2bua: session bridged in %llu ms (%s)\n",
+			      sess->lat,
+			      sess->relay ? "matched codec" : "transcode");
+		}
 		break;
 
 	case CALL_EVENT_CLOSED:
@@ -99,7 +245,8 @@ static int new_session(struct call *call)
 	if (!sess)
 		return ENOMEM;
 
-	sess->call_in = call;
+	sess->ts_start = tmr_jiffies();
+	sess->call_in  = call;
 	err = ua_connect(ua_out, &sess->call_out, call_peeruri(call),
 			 call_localuri(call),
 			 call_has_video(call) ? VIDMODE_ON : VIDMODE_OFF);
@@ -123,6 +270,14 @@ static int new_session(struct call *call)
 			  call_dtmf_handler, sess);
 
 	list_append(&sessionl, &sess->le, sess);
+	hash_append(sessh, hash_ptr(sess->call_in), &sess->hle_in, sess);
+	hash_append(sessh, hash_ptr(sess->call_out), &sess->hle_out, sess);
+	hash_append(sessidh, hash_fast_str(call_id(sess->call_in)),
+		    &sess->ile_in, sess);
+	hash_append(sessidh, hash_fast_str(call_id(sess->call_out)),
+		    &sess->ile_out, sess);
+
+	setup_tsv[n_sess_total++ % SETUP_RATE_WIN] = sess->ts_start;
 
  out:
 	if (err)
@@ -144,6 +299,9 @@ static void event_handler(enum ua_event ev, struct bevent *event, void *arg)
 		debug("b2bua: CALL_INCOMING: peer=%s  -->  local=%s\n",
 		      call_peeruri(call), call_localuri(call));
 
+		if (session_lookup(call))
+			break;
+
 		err = new_session(call);
 		if (err) {
 			call_hangup(call, 500, "Server Error");
@@ -174,9 +332,10 @@ static int b2bua_status(struct re_printf *pf, void *arg)
 
 		struct session *sess = le->data;
 
-		err |= re_hprintf(pf, "%-42s  --->  %42s\n",
+		err |= re_hprintf(pf, "%-42s  --->  %42s [%s]\n",
 				  call_peeruri(sess->call_in),
-				  call_peeruri(sess->call_out));
+				  call_peeruri(sess->call_out),
+				  sess->relay ? "matched" : "transcode");
 
 		err |= re_hprintf(pf, " %H\n", call_status, sess->call_in);
 		err |= re_hprintf(pf, " %H\n", call_status, sess->call_out);
@@ -186,8 +345,63 @@ static int b2bua_status(struct re_printf *pf, void *arg)
 }
 
 
+/*
+ * Print b2bua session statistics
+ *
+ * With a Call-ID as parameter the session of the matching leg is
+ * printed, otherwise aggregate counters are shown.
+ */
+static int b2bua_stats(struct re_printf *pf, void *arg)
+{
+	struct cmd_arg *carg = arg;
+	int err = 0;
+
+	if (str_isset(carg->prm)) {
+		struct session *sess = session_lookup_id(carg->prm);
+
+		if (!sess)
+			return re_hprintf(pf, "no session with id %s\n",
+					  carg->prm);
+
+		return re_hprintf(pf, "%s  --->  %s [%s] latency %llu ms\n",
+				  call_peeruri(sess->call_in),
+				  call_peeruri(sess->call_out),
+				  sess->relay ? "matched" : "transcode",
+				  sess->lat);
+	}
+
+	err |= re_hprintf(pf, "B2BUA stats:\n");
+	err |= re_hprintf(pf, "  active sessions:  %u\n",
+			  list_count(&sessionl));
+	err |= re_hprintf(pf, "  total sessions:   %llu\n", n_sess_total);
+
+	if (n_sess_total >= 2) {
+		uint64_t n = min(n_sess_total, (uint64_t)SETUP_RATE_WIN);
+		uint64_t newest = setup_tsv[(n_sess_total - 1) %
+					   SETUP_RATE_WIN];
+		uint64_t oldest = setup_tsv[(n_sess_total - n) %
+					   SETUP_RATE_WIN];
+
+		if (newest > oldest)
+			err |= re_hprintf(pf, "  setup rate:       "
+					  "%llu calls/s (last %llu)\n",
+					  (n - 1) * 1000 / (newest - oldest),
+					  n);
+	}
+
+	if (n_bridged) {
+		err |= re_hprintf(pf, "  bridge latency:   avg %llu ms, "
+				  "max %llu ms (n=%llu)\n",
+				  lat_sum / n_bridged, lat_max, n_bridged);
+	}
+
+	return err;
+}
+
+
 static const struct cmd cmdv[] = {
-	{"b2bua", 0,       0, "b2bua status", b2bua_status },
+	{"b2bua",       0,       0, "b2bua status", b2bua_status },
+	{"b2bua_stats", 0, CMD_PRM, "b2bua session stats", b2bua_stats },
 };
 
 
@@ -195,6 +409,11 @@ static int module_init(void)
 {
 	int err;
 
+	err  = hash_alloc(&sessh,   HASH_SIZE);
+	err |= hash_alloc(&sessidh, HASH_SIZE);
+	if (err)
+		return err;
+
 	ua_in  = uag_find_param("b2bua", "inbound");
 	ua_out = uag_find_param("b2bua", "outbound");
 
@@ -237,6 +456,9 @@ static int module_close(void)
 	bevent_unregister(event_handler);
 	cmd_unregister(baresip_commands(), cmdv);
 
+	sessh   = mem_deref(sessh);
+	sessidh = mem_deref(sessidh);
+
 	return 0;
 }
 
@@ -8,10 +8,17 @@
 #include <string.h>
 #include <stdlib.h>
 #include <re.h>
+#include <re_atomic.h>
 #include <rem.h>
 #include <baresip.h>
 #include <fvad.h>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 /**
  * @defgroup fvad fvad
@@ -19,14 +26,72 @@
  * Voice Activity Detection for the audio-signal.
  *
  * It is using the aufilt API to get the audio samples.
+ *
+ * With `fvad_async yes` the filter callbacks only copy the frame into
+ * a per-stream ring and a shared worker runs the detector, including
+ * stereo downmix and float conversion. Verdicts are delivered to the
+ * main thread via mqueue and emitted as the usual module events. In
+ * async mode stereo and AUFMT_FLOAT streams are accepted.
  */
 
 
+enum {
+	RING_SIZE  = 131072,                     /* bytes, power of two */
+	MAX_SAMPC  = 48000 / 1000 * 30 * 2,      /* 30 ms stereo 48kHz  */
+};
+
+
+/** Frame record header in the hand-off ring  */
+struct rec_hdr {
+	uint32_t sampc;
+	uint32_t srate;
+	uint16_t ch;
+	uint16_t fmt;
+};
+
+
+/** Single-producer/single-consumer byte ring  */
+struct vad_ring {
+	uint8_t *buf;
+	RE_ATOMIC size_t head;
+	RE_ATOMIC size_t tail;
+};
+
+
+/** Worker-side VAD instance  */
+struct vadw {
+	struct le le;
+	Fvad *fvad;               /**< Owned detector                   */
+	struct call *call;        /**< NULL after the filter is gone    */
+	const char *evname;       /**< "vad_tx" or "vad_rx"             */
+	bool last;                /**< Last verdict                     */
+	struct vad_ring ring;
+	uint8_t *raw;             /**< Worker scratch, one raw frame    */
+	int16_t *conv;            /**< Worker scratch, mono S16LE       */
+	uint32_t n_drop;          /**< Frames dropped on full ring      */
+};
+
+
+/** Shared VAD engine  */
+static struct {
+	bool enabled;
+	thrd_t tid;
+	RE_ATOMIC bool run;
+	mtx_t sig_lock;           /**< Protects the work flag           */
+	cnd_t sig;
+	bool work;
+	mtx_t lock;               /**< Protects the instance list       */
+	struct list instl;
+	struct mqueue *mq;        /**< Verdict delivery to main thread  */
+} eng;
+
+
 struct vad_enc {
 	struct aufilt_enc_st af;  /* inheritance */
 	bool vad_tx;
 	Fvad *fvad;
 	struct call *call;
+	struct vadw *w;           /**< Async engine instance (optional) */
 };
 
 
@@ -35,6 +100,7 @@ struct vad_dec {
 	bool vad_rx;
 	Fvad *fvad;
 	struct call *call;
+	struct vadw *w;           /**< Async engine instance (optional) */
 };
 
 struct filter_arg {
@@ -43,10 +109,354 @@ struct filter_arg {
 };
 
 
+static int ring_alloc(struct vad_ring *r)
+{
+	r->buf = mem_zalloc(RING_SIZE, NULL);
+	if (!r->buf)
+		return ENOMEM;
+
+	return 0;
+}
+
+
+static void ring_copy_in(struct vad_ring *r, size_t pos, const void *p,
+			 size_t n)
+{
+	size_t off = pos & (RING_SIZE - 1);
+	size_t k = min(n, RING_SIZE - off);
+
+	memcpy(r->buf + off, p, k);
+	memcpy(r->buf, (const uint8_t *)p + k, n - k);
+}
+
+
+static void ring_copy_out(const struct vad_ring *r, size_t pos, void *p,
+			  size_t n)
+{
+	size_t off = pos & (RING_SIZE - 1);
+	size_t k = min(n, RING_SIZE - off);
+
+	memcpy(p, r->buf + off, k);
+	memcpy((uint8_t *)p + k, r->buf, n - k);
+}
+
+
+/* average interleaved stereo sample pairs into n mono samples */
+static void downmix_s16(int16_t *out, const int16_t *in, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__ARM_NEON)
+	for (; i + 8 <= n; i += 8) {
+		int16x8x2_t s = vld2q_s16(in + 2*i);
+
+		vst1q_s16(out + i, vhaddq_s16(s.val[0], s.val[1]));
+	}
+#elif defined(__SSE2__)
+	for (; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(in + 2*i));
+		__m128i l = _mm_srai_epi32(_mm_slli_epi32(s, 16), 16);
+		__m128i rr = _mm_srai_epi32(s, 16);
+		__m128i m = _mm_srai_epi32(_mm_add_epi32(l, rr), 1);
+
+		_mm_storel_epi64((__m128i *)(out + i),
+				 _mm_packs_epi32(m, m));
+	}
+#endif
+	for (; i < n; i++)
+		out[i] = (int16_t)(((int32_t)in[2*i] + in[2*i + 1]) >> 1);
+}
+
+
+static void conv_f32_s16(int16_t *out, const float *in, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__ARM_NEON)
+	float32x4_t sc = vdupq_n_f32(32767.0f);
+
+	for (; i + 4 <= n; i += 4) {
+		int32x4_t v = vcvtq_s32_f32(
+				vmulq_f32(vld1q_f32(in + i), sc));
+
+		vst1_s16(out + i, vqmovn_s32(v));
+	}
+#elif defined(__SSE2__)
+	const __m128 sc = _mm_set1_ps(32767.0f);
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_cvtps_epi32(
+				_mm_mul_ps(_mm_loadu_ps(in + i), sc));
+
+		_mm_storel_epi64((__m128i *)(out + i),
+				 _mm_packs_epi32(v, v));
+	}
+#endif
+	for (; i < n; i++) {
+		float s = in[i] * 32767.0f;
+
+		if (s > 32767.0f)
+			s = 32767.0f;
+		else if (s < -32768.0f)
+			s = -32768.0f;
+
+		out[i] = (int16_t)s;
+	}
+}
+
+
+static void downmix_f32_s16(int16_t *out, const float *in, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		float s = (in[2*i] + in[2*i + 1]) * (0.5f * 32767.0f);
+
+		if (s > 32767.0f)
+			s = 32767.0f;
+		else if (s < -32768.0f)
+			s = -32768.0f;
+
+		out[i] = (int16_t)s;
+	}
+}
+
+
+static void vadw_destructor(void *arg)
+{
+	struct vadw *w = arg;
+
+	list_unlink(&w->le);
+	if (w->fvad)
+		fvad_free(w->fvad);
+
+	mem_deref(w->ring.buf);
+	mem_deref(w->raw);
+	mem_deref(w->conv);
+}
+
+
+/* delivers verdict transitions on the main thread */
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	struct vadw *w = data;
+	struct call *call;
+	(void)arg;
+
+	mtx_lock(&eng.lock);
+	call = w->call;
+	mtx_unlock(&eng.lock);
+
+	if (call) {
+		const char *desc = id ? "on" : "off";
+
+		debug("fvad: %s: %s\n", w->evname, desc);
+		module_event("fvad", w->evname, call_get_ua(call), call,
+			     desc);
+	}
+
+	mem_deref(w);
+}
+
+
+static bool vadw_process(struct vadw *w, const int16_t *sampv, size_t sampc,
+			 uint32_t srate)
+{
+	static const int chunk_times_ms[] = { 30, 20, 10 };
+	size_t pos = 0;
+
+	for (size_t i = 0; i < RE_ARRAY_SIZE(chunk_times_ms); i++) {
+
+		const size_t chunk = srate / 1000 * chunk_times_ms[i];
+
+		while (sampc - pos >= chunk) {
+
+			int err = fvad_process(w->fvad, sampv + pos, chunk);
+
+			pos += chunk;
+			if (err > 0)
+				return true;
+			else if (err < 0)
+				return w->last;
+		}
+	}
+
+	return false;
+}
+
+
+static void vadw_drain(struct vadw *w)
+{
+	struct vad_ring *r = &w->ring;
+
+	for (;;) {
+		struct rec_hdr hdr;
+		size_t tail = re_atomic_rlx(&r->tail);
+		size_t used = re_atomic_acq(&r->head) - tail;
+		const int16_t *sampv;
+		size_t sampc;
+		bool voice;
+
+		if (used < sizeof(hdr))
+			break;
+
+		ring_copy_out(r, tail, &hdr, sizeof(hdr));
+		ring_copy_out(r, tail + sizeof(hdr), w->raw,
+			      hdr.sampc * aufmt_sample_size(hdr.fmt));
+		re_atomic_rls_set(&r->tail, tail + sizeof(hdr) +
+				  hdr.sampc * aufmt_sample_size(hdr.fmt));
+
+		sampc = hdr.ch == 2 ? hdr.sampc / 2 : hdr.sampc;
+
+		if (hdr.fmt == AUFMT_S16LE && hdr.ch == 1) {
+			sampv = (const int16_t *)(void *)w->raw;
+		}
+		else if (hdr.fmt == AUFMT_S16LE) {
+			downmix_s16(w->conv,
+				    (const int16_t *)(void *)w->raw, sampc);
+			sampv = w->conv;
+		}
+		else if (hdr.ch == 1) {
+			conv_f32_s16(w->conv,
+				     (const float *)(void *)w->raw, sampc);
+			sampv = w->conv;
+		}
+		else {
+			downmix_f32_s16(w->conv,
+					(const float *)(void *)w->raw, sampc);
+			sampv = w->conv;
+		}
+
+		voice = vadw_process(w, sampv, sampc, hdr.srate);
+		if (voice != w->last) {
+			w->last = voice;
+			mqueue_push(eng.mq, voice, mem_ref(w));
+		}
+	}
+}
+
+
+static int worker_thread(void *arg)
+{
+	(void)arg;
+
+	while (re_atomic_rlx(&eng.run)) {
+		struct le *le;
+
+		mtx_lock(&eng.sig_lock);
+		while (!eng.work && re_atomic_rlx(&eng.run))
+			cnd_wait(&eng.sig, &eng.sig_lock);
+
+		eng.work = false;
+		mtx_unlock(&eng.sig_lock);
+
+		mtx_lock(&eng.lock);
+		LIST_FOREACH(&eng.instl, le)
+			vadw_drain(le->data);
+
+		mtx_unlock(&eng.lock);
+	}
+
+	return 0;
+}
+
+
+static int init_fvad(Fvad **fvad, const struct aufilt_prm *prm);
+
+
+static int vadw_alloc(struct vadw **wp, const struct aufilt_prm *prm,
+		      struct call *call, const char *evname)
+{
+	struct vadw *w;
+	int err;
+
+	w = mem_zalloc(sizeof(*w), vadw_destructor);
+	if (!w)
+		return ENOMEM;
+
+	err = init_fvad(&w->fvad, prm);
+	if (err)
+		goto out;
+
+	err = ring_alloc(&w->ring);
+	if (err)
+		goto out;
+
+	w->raw  = mem_zalloc(MAX_SAMPC * sizeof(float), NULL);
+	w->conv = mem_zalloc(MAX_SAMPC * sizeof(int16_t), NULL);
+	if (!w->raw || !w->conv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	w->call   = call;
+	w->evname = evname;
+
+	mtx_lock(&eng.lock);
+	list_append(&eng.instl, &w->le, w);
+	mtx_unlock(&eng.lock);
+
+ out:
+	if (err)
+		mem_deref(w);
+	else
+		*wp = w;
+
+	return err;
+}
+
+
+static void vadw_detach(struct vadw **wp)
+{
+	struct vadw *w = *wp;
+
+	if (!w)
+		return;
+
+	mtx_lock(&eng.lock);
+	list_unlink(&w->le);
+	w->call = NULL;
+	mtx_unlock(&eng.lock);
+
+	*wp = mem_deref(w);
+}
+
+
+/* audio-thread side: copy the frame and wake the worker */
+static void vadw_feed(struct vadw *w, const struct auframe *af)
+{
+	struct vad_ring *r = &w->ring;
+	struct rec_hdr hdr;
+	size_t bytes = auframe_size(af);
+	size_t head = re_atomic_rlx(&r->head);
+	size_t used = head - re_atomic_acq(&r->tail);
+
+	if (af->sampc > MAX_SAMPC ||
+	    sizeof(hdr) + bytes > RING_SIZE - used) {
+		++w->n_drop;
+		return;
+	}
+
+	hdr.sampc = (uint32_t)af->sampc;
+	hdr.srate = af->srate;
+	hdr.ch    = af->ch;
+	hdr.fmt   = (uint16_t)af->fmt;
+
+	ring_copy_in(r, head, &hdr, sizeof(hdr));
+	ring_copy_in(r, head + sizeof(hdr), af->sampv, bytes);
+	re_atomic_rls_set(&r->head, head + sizeof(hdr) + bytes);
+
+	mtx_lock(&eng.sig_lock);
+	eng.work = true;
+	cnd_signal(&eng.sig);
+	mtx_unlock(&eng.sig_lock);
+}
+
+
 static void enc_destructor(void *arg)
 {
 	struct vad_enc *st = arg;
 
+	vadw_detach(&st->w);
+
 	if (st->fvad)
 		fvad_free(st->fvad);
 
@@ -58,6 +468,8 @@ static void dec_destructor(void *arg)
 {
 	struct vad_dec *st = arg;
 
+	vadw_detach(&st->w);
+
 	if (st->fvad)
 		fvad_free(st->fvad);
 
@@ -86,12 +498,13 @@ static int check_fvad_params(const struct aufilt_prm *prm)
 	if (!prm)
 		return EINVAL;
 
-	if (prm->ch != 1) {
+	if (prm->ch != 1 && !(eng.enabled && prm->ch == 2)) {
 		warning("fvad: only mono is supported\n");
 		return EINVAL;
 	}
 
-	if (prm->fmt != AUFMT_S16LE) {
+	if (prm->fmt != AUFMT_S16LE &&
+	    !(eng.enabled && prm->fmt == AUFMT_FLOAT)) {
 		warning("fvad: only AUFMT_S16LE is supported. "
 			"Use the auconv module to fix this\n");
 		return EINVAL;
@@ -152,12 +565,6 @@ static int encode_update(struct aufilt_enc_st **stp, void **ctx,
 	if (!st)
 		return ENOMEM;
 
-	err = init_fvad(&st->fvad, prm);
-	if (err) {
-		mem_deref(st);
-		return err;
-	}
-
 	if (!st->call) {
 		struct filter_arg fa = { au, NULL };
 
@@ -165,6 +572,16 @@ static int encode_update(struct aufilt_enc_st **stp, void **ctx,
 		st->call = fa.call;
 	}
 
+	if (eng.enabled)
+		err = vadw_alloc(&st->w, prm, st->call, "vad_tx");
+	else
+		err = init_fvad(&st->fvad, prm);
+
+	if (err) {
+		mem_deref(st);
+		return err;
+	}
+
 	*stp = (struct aufilt_enc_st *)st;
 	return 0;
 }
@@ -191,12 +608,6 @@ static int decode_update(struct aufilt_dec_st **stp, void **ctx,
 	if (!st)
 		return ENOMEM;
 
-	err = init_fvad(&st->fvad, prm);
-	if (err) {
-		mem_deref(st);
-		return err;
-	}
-
 	if (!st->call) {
 		struct filter_arg fa = { au, NULL };
 
@@ -204,6 +615,16 @@ static int decode_update(struct aufilt_dec_st **stp, void **ctx,
 		st->call = fa.call;
 	}
 
+	if (eng.enabled)
+		err = vadw_alloc(&st->w, prm, st->call, "vad_rx");
+	else
+		err = init_fvad(&st->fvad, prm);
+
+	if (err) {
+		mem_deref(st);
+		return err;
+	}
+
 	*stp = (struct aufilt_dec_st *)st;
 	return 0;
 }
@@ -262,6 +683,11 @@ static int encode(struct aufilt_enc_st *st, struct auframe *af)
 	if (!st || !af)
 		return EINVAL;
 
+	if (vad->w) {
+		vadw_feed(vad->w, af);
+		return 0;
+	}
+
 	bool vad_tx = auframe_vad(vad->fvad, af);
 
 	if (vad_tx != vad->vad_tx) {
@@ -284,6 +710,11 @@ static int decode(struct aufilt_dec_st *st, struct auframe *af)
 	if (!st || !af)
 		return EINVAL;
 
+	if (vad->w) {
+		vadw_feed(vad->w, af);
+		return 0;
+	}
+
 	bool vad_rx = auframe_vad(vad->fvad, af);
 
 	if (vad_rx != vad->vad_rx) {
@@ -334,6 +765,32 @@ static int module_init(void)
 		return 0;
 	}
 
+	conf_get_bool(conf, "fvad_async", &eng.enabled);
+	if (eng.enabled) {
+		int err = mqueue_alloc(&eng.mq, mqueue_handler, NULL);
+		if (err)
+			return err;
+
+		err  = mtx_init(&eng.sig_lock, mtx_plain) != thrd_success;
+		err |= mtx_init(&eng.lock, mtx_plain) != thrd_success;
+		err |= cnd_init(&eng.sig) != thrd_success;
+		if (err) {
+			eng.mq = mem_deref(eng.mq);
+			return ENOMEM;
+		}
+
+		re_atomic_rlx_set(&eng.run, true);
+		err = thread_create_name(&eng.tid, "fvad", worker_thread,
+					 NULL);
+		if (err) {
+			eng.mq = mem_deref(eng.mq);
+			eng.enabled = false;
+			return err;
+		}
+
+		info("fvad: async engine started\n");
+	}
+
 	aufilt_register(baresip_aufiltl(), &vad);
 
 	return 0;
@@ -345,6 +802,17 @@ static int module_close(void)
 	if (vad.dech || vad.ench)
 		aufilt_unregister(&vad);
 
+	if (eng.enabled) {
+		re_atomic_rlx_set(&eng.run, false);
+		mtx_lock(&eng.sig_lock);
+		eng.work = true;
+		cnd_signal(&eng.sig);
+		mtx_unlock(&eng.sig_lock);
+		thrd_join(eng.tid, NULL);
+		eng.mq = mem_deref(eng.mq);
+		eng.enabled = false;
+	}
+
 	return 0;
 }
 
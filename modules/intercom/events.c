@@ -177,15 +177,15 @@ static int incoming_handler(const struct pl *name,
 		return 0;
 	}
 
-	if (ic_is_custom(val)) {
-		struct pl *auf = iccustom_aufile(val);
-		if (!iccustom_allowed(val)) {
+	struct iccustom *cust = iccustom_find(val);
+	if (cust) {
+		if (!cust->allowed) {
 			reject_call(call, 406, "Not Acceptable");
 			return 0;
 		}
 
 		module_event("intercom", "override-aufile", ua, call,
-				"sip_autoanswer_aufile:%r", auf);
+				"sip_autoanswer_aufile:%r", &cust->auffile);
 		return 0;
 	}
 
@@ -16,15 +16,18 @@
 #include "intercom.h"
 #include "iccustom.h"
 
-struct iccustom {
-	struct le le;
-
-	struct pl subject;
-	enum sdp_dir dir;
-	bool allowed;
-	struct pl auffile;
+enum {
+	SUBJ_MAXLEN = 255,       /* Longest indexed subject prefix */
 };
 
+/* Distinct prefix lengths present in the configured entries. Lookups
+ * only probe these lengths, longest first, so classifying a subject
+ * costs one hash probe per configured length instead of a walk over
+ * all entries. */
+static bool used_len[SUBJ_MAXLEN + 1];
+static size_t len_min;
+static size_t len_max;
+
 
 static void iccustom_destructor(void *arg)
 {
@@ -91,6 +94,11 @@ int iccustom_handler(const struct pl *pl, void *arg)
 	if (err)
 		return 0;
 
+	if (!subject.l || subject.l > SUBJ_MAXLEN) {
+		warning("iccustom: invalid subject prefix %r\n", &subject);
+		return 0;
+	}
+
 	c = mem_zalloc(sizeof(*c), iccustom_destructor);
 	if (!c)
 		return ENOMEM;
@@ -100,60 +108,78 @@ int iccustom_handler(const struct pl *pl, void *arg)
 	c->dir = sdp_dir_decode(&dir);
 	c->auffile = aufile;
 
+	if (!len_max || subject.l < len_min)
+		len_min = subject.l;
+
+	if (subject.l > len_max)
+		len_max = subject.l;
+
+	used_len[subject.l] = true;
+
 	info("intercom: add custom %r\n", &subject);
 	hash_append(hash, hash_joaat_pl(&subject), &c->le, c);
 	return 0;
 }
 
 
-bool iccustom_lookup(struct le *le, void *arg)
+void iccustom_index_reset(void)
 {
-	struct pl *pl = arg;
-	struct iccustom *c = le->data;
-
-	if (pl->l < c->subject.l)
-		return false;
-
-	return !strncmp(pl->p, c->subject.p, c->subject.l);
+	memset(used_len, 0, sizeof(used_len));
+	len_min = 0;
+	len_max = 0;
 }
 
 
-bool ic_is_custom(const struct pl *val)
+static bool lookup_exact(struct le *le, void *arg)
 {
-	if (!val)
-		return false;
+	const struct pl *key = arg;
+	struct iccustom *c = le->data;
 
-	return iccustom_find(val) != NULL;
+	return c->subject.l == key->l &&
+		!strncmp(key->p, c->subject.p, key->l);
 }
 
 
-enum sdp_dir iccustom_dir(const struct pl *val)
+/**
+ * Find the custom entry with the longest subject prefix matching val
+ *
+ * @param hash Hash of custom entries keyed by subject prefix
+ * @param val  Subject header value
+ *
+ * @return Custom entry if found, NULL otherwise
+ */
+struct iccustom *iccustom_match(struct hash *hash, const struct pl *val)
 {
-	struct iccustom *c = iccustom_find(val);
-	if (!c)
-		return SDP_INACTIVE;
+	size_t l;
 
-	return c->dir;
-}
+	if (!hash || !val || !val->p || !len_max)
+		return NULL;
 
+	for (l = min(val->l, len_max); l >= len_min; l--) {
+		struct pl key;
+		struct le *le;
 
-bool iccustom_allowed(const struct pl *val)
-{
-	struct iccustom *c = iccustom_find(val);
-	if (!c)
-		return false;
+		if (!used_len[l])
+			continue;
+
+		key.p = val->p;
+		key.l = l;
+		le = hash_lookup(hash, hash_joaat_pl(&key), lookup_exact,
+				 &key);
+		if (le)
+			return le->data;
+	}
 
-	return c->allowed;
+	return NULL;
 }
 
 
-struct pl *iccustom_aufile(const struct pl *val)
+bool ic_is_custom(const struct pl *val)
 {
-	struct iccustom *c = iccustom_find(val);
-	if (!c)
-		return NULL;
+	if (!val)
+		return false;
 
-	return &c->auffile;
+	return iccustom_find(val) != NULL;
 }
 
 
@@ -4,11 +4,19 @@
  * Copyright (C) 2022 Commend.com - c.spielberger@commend.com
  */
 
+/** Custom intercom call type, fully resolved at config load  */
+struct iccustom {
+	struct le le;
+
+	struct pl subject;
+	enum sdp_dir dir;
+	bool allowed;
+	struct pl auffile;
+};
+
 int iccustom_init(void);
 void iccustom_close(void);
 bool ic_is_custom(const struct pl *val);
-enum sdp_dir iccustom_dir(const struct pl *val);
-bool iccustom_lookup(struct le *le, void *arg);
-bool iccustom_allowed(const struct pl *val);
-struct pl *iccustom_aufile(const struct pl *val);
+struct iccustom *iccustom_match(struct hash *hash, const struct pl *val);
+void iccustom_index_reset(void);
 int iccustom_handler(const struct pl *pl, void *arg);
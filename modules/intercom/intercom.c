@@ -290,6 +290,7 @@ static int cmd_reload(struct re_printf *pf, void *arg)
 	}
 
 	hash_flush(st.custom);
+	iccustom_index_reset();
 	err = conf_apply(conf_cur(), "iccustom", iccustom_handler,
 			 st.custom);
 	return err;
@@ -329,15 +330,7 @@ static const struct cmd cmdv[] = {
 
 struct iccustom *iccustom_find(const struct pl *val)
 {
-	struct pl key;
-	struct le *le;
-
-	key = *val;
-	le = hash_apply(st.custom, iccustom_lookup, &key);
-	if (le)
-		return le->data;
-
-	return NULL;
+	return iccustom_match(st.custom, val);
 }
 
 
@@ -374,6 +367,7 @@ static int module_close(void)
 {
 
 	hash_flush(st.custom);
+	iccustom_index_reset();
 	mem_deref(st.custom);
 	mem_deref(st.ansval);
 	cmd_unregister(baresip_commands(), cmdv);
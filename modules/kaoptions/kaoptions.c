@@ -28,6 +28,13 @@
  * Example:
  * <sip:A@sip.example.com>;extra=kaoptions=30
  *
+ * All keepalives are driven by one periodic tick. Each UA gets a
+ * deterministic phase offset within its interval derived from the
+ * account AOR, so many accounts with the same interval do not fire
+ * their OPTIONS in one burst.
+ *
+ * Commands:
+ * kaoptions_stats      print sent/answered/timed-out counters per UA
  */
 
 
@@ -36,23 +43,31 @@
 #include <re_dbg.h>
 
 
+enum {
+	TICK_INTERVAL = 1000,    /* Scheduler tick in [ms] */
+};
+
+
 struct kaoptions {
 	struct list ka_ual;
+	struct tmr tick;         /**< One tick drives all keepalives */
 };
 
 
-static struct kaoptions kao = {
-	LIST_INIT,
-};
+static struct kaoptions kao;
 
 
 struct kao_element {
 	struct le le;
 
 	struct ua *ua;
-	struct tmr tmr;
 
 	size_t ka_interval;
+	uint64_t next;           /**< Next send deadline in [ms]     */
+
+	uint32_t n_sent;
+	uint32_t n_answered;
+	uint32_t n_timeout;
 };
 
 
@@ -60,7 +75,7 @@ static void kao_element_destructor(void *arg)
 {
 	struct kao_element *kaoe = arg;
 
-	tmr_cancel(&kaoe->tmr);
+	list_unlink(&kaoe->le);
 }
 
 
@@ -113,34 +128,76 @@ static int account_extra_int(const struct account *acc, const char *n, int *v)
 }
 
 
+static void options_resp_handler(int err, const struct sip_msg *msg,
+				 void *arg)
+{
+	struct kao_element *kaoe = arg;
+	(void)msg;
+
+	if (err)
+		++kaoe->n_timeout;
+	else
+		++kaoe->n_answered;
+
+	mem_deref(kaoe);
+}
+
+
 /**
- * Keepalive timer handler
+ * Send a keepalive OPTIONS for one element
  *
- * @param arg Argument (kao_element)
+ * @param kaoe Keepalive element
  */
-static void keepalive_send_handler(void *arg)
+static void keepalive_send(struct kao_element *kaoe)
 {
-	struct account *acc = NULL;
-	struct kao_element *kaoe = arg;
+	struct account *acc = ua_account(kaoe->ua);
 	char *uri = NULL;
-	int err = 0;
+	int err;
 
-	acc = ua_account(kaoe->ua);
 	err = re_sdprintf(&uri, "%H", uri_encode, account_luri(acc));
 	if (err)
-		goto out;
+		return;
 
-	err = ua_options_send(kaoe->ua, uri, NULL, NULL);
+	err = ua_options_send(kaoe->ua, uri, options_resp_handler,
+			      mem_ref(kaoe));
 	if (err)
-		goto out;
+		mem_deref(kaoe);
+	else
+		++kaoe->n_sent;
 
-	tmr_start(&kaoe->tmr, kaoe->ka_interval, keepalive_send_handler, kaoe);
-
-out:
 	mem_deref(uri);
 }
 
 
+/**
+ * Scheduler tick, sends all due keepalives
+ *
+ * @param arg Argument (not used)
+ */
+static void tick_handler(void *arg)
+{
+	uint64_t now = tmr_jiffies();
+	struct le *le;
+	(void)arg;
+
+	LIST_FOREACH(&kao.ka_ual, le) {
+		struct kao_element *kaoe = le->data;
+
+		if (now < kaoe->next)
+			continue;
+
+		keepalive_send(kaoe);
+
+		do
+			kaoe->next += kaoe->ka_interval;
+		while (kaoe->next <= now);
+	}
+
+	if (!list_isempty(&kao.ka_ual))
+		tmr_start(&kao.tick, TICK_INTERVAL, tick_handler, NULL);
+}
+
+
 /**
  * Allocate and start a SIP OPTIONS keepalive for a given ua
  *
@@ -164,6 +221,9 @@ static int kaoptions_alloc(struct ua *ua)
 	if (err)
 		return err;
 
+	if (sec <= 0)
+		return EINVAL;
+
 	le = list_apply(&kao.ka_ual, true, kao_element_ua_cmp, ua);
 	if (le)
 		return 0;
@@ -174,7 +234,14 @@ static int kaoptions_alloc(struct ua *ua)
 
 	kaoe->ua = ua;
 	kaoe->ka_interval = sec * 1000;
-	tmr_start(&kaoe->tmr, kaoe->ka_interval, keepalive_send_handler, kaoe);
+
+	/* deterministic phase offset spreads accounts with the same
+	 * interval uniformly instead of bursting them together */
+	kaoe->next = tmr_jiffies() + kaoe->ka_interval -
+		hash_fast_str(account_aor(acc)) % kaoe->ka_interval;
+
+	if (list_isempty(&kao.ka_ual))
+		tmr_start(&kao.tick, TICK_INTERVAL, tick_handler, NULL);
 
 	list_append(&kao.ka_ual, &kaoe->le, kaoe);
 
@@ -205,10 +272,48 @@ static int kaoptions_stop(struct ua *ua)
 	list_unlink(&kaoe->le);
 	mem_deref(kaoe);
 
+	if (list_isempty(&kao.ka_ual))
+		tmr_cancel(&kao.tick);
+
 	return 0;
 }
 
 
+/**
+ * Print keepalive counters per UA
+ *
+ * @param pf  Print handler
+ * @param arg Argument (not used)
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int cmd_kao_stats(struct re_printf *pf, void *arg)
+{
+	struct le *le;
+	int err;
+	(void)arg;
+
+	err = re_hprintf(pf, "keepalive OPTIONS:\n");
+	LIST_FOREACH(&kao.ka_ual, le) {
+		const struct kao_element *kaoe = le->data;
+
+		err |= re_hprintf(pf, "  %s sent=%u answered=%u "
+				  "timed-out=%u\n",
+				  account_aor(ua_account(kaoe->ua)),
+				  kaoe->n_sent, kaoe->n_answered,
+				  kaoe->n_timeout);
+	}
+
+	return err;
+}
+
+
+static const struct cmd cmdv[] = {
+	{"kaoptions_stats", 0, 0, "Keepalive OPTIONS counters",
+							cmd_kao_stats},
+};
+
+
 static void event_handler(enum ua_event ev, struct bevent *event, void *arg)
 {
 	struct ua *ua = bevent_get_ua(event);
@@ -235,7 +340,8 @@ static int module_init(void)
 {
 	int err;
 
-	err = bevent_register(event_handler, NULL);
+	err  = bevent_register(event_handler, NULL);
+	err |= cmd_register(baresip_commands(), cmdv, RE_ARRAY_SIZE(cmdv));
 
 	info("kaoptions: init\n");
 	return err;
@@ -245,6 +351,8 @@ static int module_init(void)
 static int module_close(void)
 {
 	bevent_unregister(event_handler);
+	cmd_unregister(baresip_commands(), cmdv);
+	tmr_cancel(&kao.tick);
 	list_flush(&kao.ka_ual);
 
 	return 0;
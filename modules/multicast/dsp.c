@@ -0,0 +1,241 @@
+/**
+ * @file dsp.c  Multicast vectorized sample kernels
+ *
+ * Copyright (C) 2021 Commend.com - c.huber@commend.com
+ */
+
+#include <re.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "multicast.h"
+
+#define DEBUG_MODULE "mcdsp"
+#define DEBUG_LEVEL 6
+#include <re_dbg.h>
+
+
+/**
+ * Apply a per-sample gain vector to a block of S16LE samples
+ *
+ * The gain values are read from a precomputed ramp table, forward for
+ * fade-in and backward for fade-out. The scalar tail handles lengths
+ * that are not a multiple of the vector width.
+ *
+ * @param sampv   Sample buffer
+ * @param gainv   First gain value of the ramp
+ * @param n       Number of samples
+ * @param reverse True to walk the gain table backwards
+ */
+void mcdsp_gain_ramp(int16_t *sampv, const float *gainv, size_t n,
+	bool reverse)
+{
+	size_t i = 0;
+
+	if (!sampv || !gainv)
+		return;
+
+#if defined(__ARM_NEON)
+	for (; i + 4 <= n; i += 4) {
+		int16x4_t s = vld1_s16(&sampv[i]);
+		float32x4_t f = vcvtq_f32_s32(vmovl_s16(s));
+		float32x4_t g;
+
+		if (reverse) {
+			float32x4_t t = vld1q_f32(gainv - i - 3);
+			g = vcombine_f32(vrev64_f32(vget_high_f32(t)),
+				vrev64_f32(vget_low_f32(t)));
+		}
+		else {
+			g = vld1q_f32(&gainv[i]);
+		}
+
+		f = vmulq_f32(f, g);
+		vst1_s16(&sampv[i], vqmovn_s32(vcvtq_s32_f32(f)));
+	}
+#elif defined(__SSE2__)
+	for (; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadl_epi64((const __m128i *)&sampv[i]);
+		__m128i s32;
+		__m128 f, g;
+
+		s32 = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+		f = _mm_cvtepi32_ps(s32);
+
+		if (reverse) {
+			g = _mm_loadu_ps(gainv - i - 3);
+			g = _mm_shuffle_ps(g, g, _MM_SHUFFLE(0, 1, 2, 3));
+		}
+		else {
+			g = _mm_loadu_ps(&gainv[i]);
+		}
+
+		f = _mm_mul_ps(f, g);
+		s32 = _mm_cvtps_epi32(f);
+		s = _mm_packs_epi32(s32, s32);
+		_mm_storel_epi64((__m128i *)&sampv[i], s);
+	}
+#endif
+
+	for (; i < n; i++) {
+		float g = reverse ? *(gainv - i) : gainv[i];
+
+		sampv[i] = (int16_t)(sampv[i] * g);
+	}
+}
+
+
+/**
+ * Convert S16LE samples to normalized float
+ *
+ * Same scaling as the auconv module, so the result is a drop-in
+ * replacement for an AUFMT_FLOAT frame.
+ *
+ * @param out Destination float buffer
+ * @param in  Source S16LE buffer
+ * @param n   Number of samples
+ */
+void mcdsp_s16_to_float(float *out, const int16_t *in, size_t n)
+{
+	const float scale = 1.f / 32768.f;
+	size_t i = 0;
+
+	if (!out || !in)
+		return;
+
+#if defined(__ARM_NEON)
+	{
+		float32x4_t s = vdupq_n_f32(scale);
+
+		for (; i + 4 <= n; i += 4) {
+			int16x4_t v = vld1_s16(&in[i]);
+			float32x4_t f = vcvtq_f32_s32(vmovl_s16(v));
+
+			vst1q_f32(&out[i], vmulq_f32(f, s));
+		}
+	}
+#elif defined(__SSE2__)
+	{
+		__m128 s = _mm_set1_ps(scale);
+
+		for (; i + 4 <= n; i += 4) {
+			__m128i v = _mm_loadl_epi64(
+				(const __m128i *)&in[i]);
+			__m128i v32;
+
+			v32 = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+			_mm_storeu_ps(&out[i],
+				_mm_mul_ps(_mm_cvtepi32_ps(v32), s));
+		}
+	}
+#endif
+
+	for (; i < n; i++)
+		out[i] = in[i] * scale;
+}
+
+
+/**
+ * Convert normalized float samples to S16LE with saturation
+ *
+ * @param out Destination S16LE buffer
+ * @param in  Source float buffer
+ * @param n   Number of samples
+ */
+void mcdsp_float_to_s16(int16_t *out, const float *in, size_t n)
+{
+	const float scale = 32767.f;
+	size_t i = 0;
+
+	if (!out || !in)
+		return;
+
+#if defined(__ARM_NEON)
+	{
+		float32x4_t s = vdupq_n_f32(scale);
+
+		for (; i + 4 <= n; i += 4) {
+			float32x4_t f = vmulq_f32(vld1q_f32(&in[i]), s);
+
+			vst1_s16(&out[i], vqmovn_s32(vcvtq_s32_f32(f)));
+		}
+	}
+#elif defined(__SSE2__)
+	{
+		__m128 s = _mm_set1_ps(scale);
+
+		for (; i + 4 <= n; i += 4) {
+			__m128 f = _mm_mul_ps(_mm_loadu_ps(&in[i]), s);
+			__m128i v32 = _mm_cvtps_epi32(f);
+
+			v32 = _mm_packs_epi32(v32, v32);
+			_mm_storel_epi64((__m128i *)&out[i], v32);
+		}
+	}
+#endif
+
+	for (; i < n; i++) {
+		float f = in[i] * scale;
+
+		if (f > 32767.f)
+			f = 32767.f;
+		else if (f < -32768.f)
+			f = -32768.f;
+
+		out[i] = (int16_t)f;
+	}
+}
+
+
+/**
+ * Apply a constant gain to a block of S16LE samples
+ *
+ * @param sampv Sample buffer
+ * @param gain  Gain value
+ * @param n     Number of samples
+ */
+void mcdsp_gain_const(int16_t *sampv, float gain, size_t n)
+{
+	size_t i = 0;
+
+	if (!sampv)
+		return;
+
+#if defined(__ARM_NEON)
+	{
+		float32x4_t g = vdupq_n_f32(gain);
+
+		for (; i + 4 <= n; i += 4) {
+			int16x4_t s = vld1_s16(&sampv[i]);
+			float32x4_t f = vcvtq_f32_s32(vmovl_s16(s));
+
+			f = vmulq_f32(f, g);
+			vst1_s16(&sampv[i], vqmovn_s32(vcvtq_s32_f32(f)));
+		}
+	}
+#elif defined(__SSE2__)
+	{
+		__m128 g = _mm_set1_ps(gain);
+
+		for (; i + 4 <= n; i += 4) {
+			__m128i s = _mm_loadl_epi64(
+				(const __m128i *)&sampv[i]);
+			__m128i s32;
+			__m128 f;
+
+			s32 = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+			f = _mm_mul_ps(_mm_cvtepi32_ps(s32), g);
+			s32 = _mm_cvtps_epi32(f);
+			s = _mm_packs_epi32(s32, s32);
+			_mm_storel_epi64((__m128i *)&sampv[i], s);
+		}
+	}
+#endif
+
+	for (; i < n; i++)
+		sampv[i] = (int16_t)(sampv[i] * gain);
+}
@@ -305,6 +305,40 @@ static int cmd_mcinfo(struct re_printf *pf, void *arg)
 }
 
 
+/**
+ * Print packet pool statistics
+ *
+ * @param pf  Printer
+ * @param arg Command arguments
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int cmd_mcpool(struct re_printf *pf, void *arg)
+{
+	(void)arg;
+
+	return mcpool_print(pf);
+}
+
+
+/**
+ * Print RTP statistics of all multicast receiver
+ *
+ * @param pf  Printer
+ * @param arg Command arguments
+ *
+ * @return always 0
+ */
+static int cmd_mcstats(struct re_printf *pf, void *arg)
+{
+	(void)arg;
+
+	mcreceiver_stats(pf);
+
+	return 0;
+}
+
+
 /**
  * Create a new multicast listener with prio
  *
@@ -704,6 +738,8 @@ static int module_read_config(void)
 
 static const struct cmd cmdv[] = {
 	{"mcinfo",    0, CMD_PRM, "Show multicast information", cmd_mcinfo   },
+	{"mcpool",    0, CMD_PRM, "Show packet pool statistics", cmd_mcpool  },
+	{"mcstats",   0, CMD_PRM, "Show receiver RTP statistics", cmd_mcstats},
 
 	{"mcsend",    0, CMD_PRM, "Send multicast"            , cmd_mcsend   },
 	{"mcstop",    0, CMD_PRM, "Stop multicast"            , cmd_mcstop   },
@@ -760,6 +796,8 @@ static int module_init(void)
 	if (err)
 		return err;
 
+	err |= mcpool_init();
+	err |= mcrxengine_init();
 	err |= mcsource_init();
 	err |= mcplayer_init();
 
@@ -778,8 +816,10 @@ static int module_close(void)
 	bevent_unregister(event_handler);
 	cmd_unregister(baresip_commands(), cmdv);
 
+	mcrxengine_terminate();
 	mcsource_terminate();
 	mcplayer_terminate();
+	mcpool_terminate();
 
 	return 0;
 }
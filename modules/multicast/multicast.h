@@ -35,6 +35,26 @@ void mcsender_enable(bool enable);
 
 void mcsender_print(struct re_printf *pf);
 
+/* DSP kernels */
+void mcdsp_gain_ramp(int16_t *sampv, const float *gainv, size_t n,
+	bool reverse);
+void mcdsp_gain_const(int16_t *sampv, float gain, size_t n);
+void mcdsp_s16_to_float(float *out, const int16_t *in, size_t n);
+void mcdsp_float_to_s16(int16_t *out, const float *in, size_t n);
+
+/* Packet pool */
+int  mcpool_init(void);
+void mcpool_terminate(void);
+struct mbuf *mcpool_buf_alloc(size_t size);
+int  mcpool_print(struct re_printf *pf);
+
+/* Receive engine */
+int  mcrxengine_init(void);
+void mcrxengine_terminate(void);
+bool mcrxengine_enabled(void);
+int  mcrxengine_attach(struct udp_sock *us, udp_recv_h *rxh, void *arg);
+void mcrxengine_detach(struct udp_sock *us);
+
 /* Receiver */
 int mcreceiver_alloc(struct sa *addr, uint8_t prio);
 void mcreceiver_unregall(void);
@@ -47,6 +67,7 @@ int  mcreceiver_mute(uint32_t prio);
 void mcreceiver_enable(bool enable);
 
 void mcreceiver_print(struct re_printf *pf);
+void mcreceiver_stats(struct re_printf *pf);
 
 /* Player <exchangable player> */
 int mcplayer_start(const struct aucodec *ac);
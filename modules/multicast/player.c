@@ -44,44 +44,66 @@ struct mcplayer {
 	char *module;
 	char *device;
 	void *sampv;
+	void *convv;
 	uint32_t ptime;
 	enum aufmt play_fmt;
 	enum aufmt dec_fmt;
+	bool zerocopy;
+	bool standby_ok;
 
 	enum fade_state fades;
 	uint32_t fade_cmax;
 	uint32_t fade_c;
 	float fade_dbstart;
 	float fade_delta;
+	float *fade_tab;
 };
 
 
 static struct mcplayer *player;
 
+/* Parked pipeline kept warm for the next stream with the same codec */
+static struct mcplayer *standby;
+
 
 static void mcplayer_destructor(void *arg)
 {
-	(void) arg;
+	struct mcplayer *p = arg;
 
-	mem_deref(player->auplay);
+	mem_deref(p->auplay);
 
-	mem_deref(player->module);
-	mem_deref(player->device);
-	mem_deref(player->dec);
+	mem_deref(p->module);
+	mem_deref(p->device);
+	mem_deref(p->dec);
 
-	mem_deref(player->sampv);
-	mem_deref(player->aubuf);
-	list_flush(&player->filterl);
+	mem_deref(p->sampv);
+	mem_deref(p->convv);
+	mem_deref(p->aubuf);
+	mem_deref(p->fade_tab);
+	list_flush(&p->filterl);
+}
+
+
+/**
+ * Re-arm a warm pipeline for a new stream
+ *
+ * @param p Multicast player object
+ */
+static void mcplayer_rearm(struct mcplayer *p)
+{
+	aubuf_flush(p->aubuf);
+	p->fade_c = 0;
+	p->fades = p->fade_tab ? FM_FADEIN : FM_IDLE;
 }
 
 
 static void fade_process(struct auframe *af)
 {
-	size_t i;
-	int16_t *sampv_ptr = af->sampv;
-	float db_value;
+	int16_t *sampv = af->sampv;
+	size_t sampc = af->sampc;
+	size_t n;
 
-	if (af->fmt != AUFMT_S16LE)
+	if (af->fmt != AUFMT_S16LE || !player->fade_tab)
 		return;
 
 	switch (player->fades) {
@@ -91,27 +113,28 @@ static void fade_process(struct auframe *af)
 				return;
 			}
 
-			for (i = 0; i < af->sampc; i++) {
-				db_value = player->fade_dbstart +
-					(player->fade_c * player->fade_delta);
-				*(sampv_ptr) = *(sampv_ptr) * db_value;
-				++sampv_ptr;
-				if (player->fade_c < player->fade_cmax)
-					++player->fade_c;
-			}
+			n = player->fade_cmax - player->fade_c;
+			if (n > sampc)
+				n = sampc;
+
+			mcdsp_gain_ramp(sampv,
+				&player->fade_tab[player->fade_c], n, false);
+			player->fade_c += (uint32_t)n;
 
 			break;
 
 		case FM_FADEOUT:
-			for (i = 0; i < af->sampc; i++) {
-				db_value = player->fade_dbstart +
-					(player->fade_c * player->fade_delta);
-				*(sampv_ptr) = *(sampv_ptr) * db_value;
-				++sampv_ptr;
-
-				if (player->fade_c > 0)
-					--player->fade_c;
-			}
+			n = player->fade_c;
+			if (n > sampc)
+				n = sampc;
+
+			mcdsp_gain_ramp(sampv,
+				&player->fade_tab[player->fade_c], n, true);
+			player->fade_c -= (uint32_t)n;
+
+			if (n < sampc)
+				mcdsp_gain_const(&sampv[n],
+					player->fade_tab[0], sampc - n);
 
 			if (!player->fade_c) {
 				player->fades = FM_FADEOUTDONE;
@@ -121,12 +144,9 @@ static void fade_process(struct auframe *af)
 			break;
 
 		case FM_FADEOUTDONE:
-			for (i = 0; i < af->sampc; i++) {
-				db_value = 1. - ((player->fade_cmax - 1) *
-					player->fade_delta);
-				*(sampv_ptr) = *(sampv_ptr) * db_value;
-				++sampv_ptr;
-			}
+			mcdsp_gain_const(sampv,
+				1.f - ((player->fade_cmax - 1) *
+				player->fade_delta), sampc);
 
 			break;
 
@@ -152,6 +172,8 @@ int mcplayer_decode(const struct rtp_header *hdr, struct mbuf *mb, bool drop)
 {
 	struct auframe af;
 	struct le *le;
+	struct mbuf *fmb = NULL;
+	void *sampv;
 	size_t sampc = AUDIO_SAMPSZ;
 	bool marker = hdr->m;
 	int err = 0;
@@ -168,17 +190,29 @@ int mcplayer_decode(const struct rtp_header *hdr, struct mbuf *mb, bool drop)
 	if (player->ssrc != hdr->ssrc)
 		aubuf_flush(player->aubuf);
 
+	if (player->zerocopy) {
+		fmb = mcpool_buf_alloc(AUDIO_SAMPSZ *
+			aufmt_sample_size(player->dec_fmt));
+		if (!fmb)
+			return ENOMEM;
+
+		sampv = mbuf_buf(fmb);
+	}
+	else {
+		sampv = player->sampv;
+	}
+
 	player->ssrc = hdr->ssrc;
 	if (mbuf_get_left(mb)) {
 		err = player->ac->dech(player->dec, player->dec_fmt,
-			player->sampv, &sampc, marker,
+			sampv, &sampc, marker,
 			mbuf_buf(mb), mbuf_get_left(mb));
 		if (err)
 			goto out;
 	}
 	else if (player->ac->plch && player->dec_fmt == AUFMT_S16LE) {
 		err = player->ac->plch(player->dec, player->dec_fmt,
-			player->sampv, &sampc,
+			sampv, &sampc,
 			mbuf_buf(mb), mbuf_get_left(mb));
 		if (err)
 			goto out;
@@ -188,7 +222,7 @@ int mcplayer_decode(const struct rtp_header *hdr, struct mbuf *mb, bool drop)
 		sampc = 0;
 	}
 
-	auframe_init(&af, player->dec_fmt, player->sampv, sampc,
+	auframe_init(&af, player->dec_fmt, sampv, sampc,
 		     player->ac->srate, player->ac->ch);
 	af.timestamp = ((uint64_t) hdr->ts) * AUDIO_TIMEBASE /
 		       player->ac->crate;
@@ -204,7 +238,17 @@ int mcplayer_decode(const struct rtp_header *hdr, struct mbuf *mb, bool drop)
 	if (!player->aubuf)
 		goto out;
 
-	if (af.fmt != player->play_fmt) {
+	/* convert to S16LE before the fade so the gain ramp applies */
+	if (af.fmt == AUFMT_FLOAT && player->play_fmt == AUFMT_S16LE &&
+	    player->convv) {
+		mcdsp_float_to_s16(player->convv, af.sampv, af.sampc);
+		af.sampv = player->convv;
+		af.fmt = AUFMT_S16LE;
+	}
+
+	if (af.fmt != player->play_fmt &&
+	    !(af.fmt == AUFMT_S16LE && player->play_fmt == AUFMT_FLOAT &&
+	      player->convv)) {
 		warning("multicast player: invalid sample formats (%s -> %s)."
 			" %s\n",
 			aufmt_name(af.fmt), aufmt_name(player->play_fmt),
@@ -226,9 +270,26 @@ int mcplayer_decode(const struct rtp_header *hdr, struct mbuf *mb, bool drop)
 	}
 
 	fade_process(&af);
-	err = aubuf_write_auframe(player->aubuf, &af);
+
+	/* convert to float after the fade, which runs on S16LE */
+	if (af.fmt == AUFMT_S16LE && player->play_fmt == AUFMT_FLOAT &&
+	    player->convv) {
+		mcdsp_s16_to_float(player->convv, af.sampv, af.sampc);
+		af.sampv = player->convv;
+		af.fmt = AUFMT_FLOAT;
+	}
+
+	if (player->zerocopy && af.sampv == mbuf_buf(fmb)) {
+		fmb->pos = 0;
+		fmb->end = auframe_size(&af);
+		err = aubuf_append_auframe(player->aubuf, fmb, &af);
+	}
+	else {
+		err = aubuf_write_auframe(player->aubuf, &af);
+	}
 
   out:
+	mem_deref(fmb);
 
 	return err;
 }
@@ -329,6 +390,20 @@ int mcplayer_start(const struct aucodec *ac)
 		(player->fades == FM_FADEOUT || player->fades == FM_FADEIN))
 		return EINPROGRESS;
 
+	if (player && player->standby_ok && player->ac == ac) {
+		mcplayer_rearm(player);
+		return 0;
+	}
+
+	if (standby && standby->ac == ac) {
+		player = mem_deref(player);
+		player = standby;
+		standby = NULL;
+		mcplayer_rearm(player);
+		return 0;
+	}
+
+	standby = mem_deref(standby);
 	player = mem_deref(player);
 	player = mem_zalloc(sizeof(*player), mcplayer_destructor);
 	if (!player)
@@ -338,6 +413,10 @@ int mcplayer_start(const struct aucodec *ac)
 	player->ac = ac;
 	player->play_fmt = cfg->play_fmt;
 	player->dec_fmt = cfg->dec_fmt;
+	(void)conf_get_bool(conf_cur(), "multicast_zero_copy",
+			    &player->zerocopy);
+	(void)conf_get_bool(conf_cur(), "multicast_standby",
+			    &player->standby_ok);
 
 	err = str_dup(&player->module, cfg->play_mod);
 	err |= str_dup(&player->device, cfg->play_dev);
@@ -351,6 +430,19 @@ int mcplayer_start(const struct aucodec *ac)
 		goto out;
 	}
 
+	/* bounce buffer for the vectorized S16LE <-> float conversion */
+	if ((player->dec_fmt == AUFMT_S16LE &&
+	     player->play_fmt == AUFMT_FLOAT) ||
+	    (player->dec_fmt == AUFMT_FLOAT &&
+	     player->play_fmt == AUFMT_S16LE)) {
+		player->convv = mem_zalloc(AUDIO_SAMPSZ *
+			aufmt_sample_size(player->play_fmt), NULL);
+		if (!player->convv) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
 	player->ptime = PTIME;
 	if (player->ac->decupdh) {
 		err = player->ac->decupdh(&player->dec, player->ac, NULL);
@@ -370,11 +462,24 @@ int mcplayer_start(const struct aucodec *ac)
 	prm.fmt = player->play_fmt;
 
 	if (multicast_fade_time()) {
+		uint32_t c;
+
 		player->fade_cmax = (multicast_fade_time() * prm.srate) / 1000;
 		player->fade_dbstart = 0.001; /*-60dB*/
 		player->fade_delta = (1. - player->fade_dbstart) /
 			player->fade_cmax;
 		player->fades = FM_FADEIN;
+
+		player->fade_tab = mem_zalloc((player->fade_cmax + 1) *
+			sizeof(float), NULL);
+		if (!player->fade_tab) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		for (c = 0; c <= player->fade_cmax; c++)
+			player->fade_tab[c] = player->fade_dbstart +
+				(c * player->fade_delta);
 	}
 
 	if (!player->aubuf) {
@@ -431,9 +536,21 @@ int mcplayer_start(const struct aucodec *ac)
 
 /**
  * Stop multicast player
+ *
+ * With multicast_standby enabled the pipeline (decoder, aubuf and the
+ * open playback device) is parked instead of destroyed, so the next
+ * stream with the same codec starts without re-opening the device.
  */
 void mcplayer_stop(void)
 {
+	if (player && player->standby_ok) {
+		mcplayer_rearm(player);
+		standby = mem_deref(standby);
+		standby = player;
+		player = NULL;
+		return;
+	}
+
 	player = mem_deref(player);
 }
 
@@ -500,5 +617,6 @@ int mcplayer_init(void)
  */
 void mcplayer_terminate(void)
 {
+	standby = mem_deref(standby);
 	return;
 }
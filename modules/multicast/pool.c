@@ -0,0 +1,205 @@
+/**
+ * @file pool.c  Multicast packet buffer pool
+ *
+ * Copyright (C) 2021 Commend.com - c.huber@commend.com
+ */
+
+#include <re.h>
+#include <baresip.h>
+
+#include "multicast.h"
+
+#define DEBUG_MODULE "mcpool"
+#define DEBUG_LEVEL 6
+#include <re_dbg.h>
+
+
+enum {
+	POOL_DEFSZ  = 256,                 /* Default number of slots      */
+	POOL_MAXSZ  = 4096,                /* Upper bound for config value */
+
+	/* One slot holds a full decoded frame in the largest sample
+	 * format, which also covers any RTP datagram */
+	POOL_SLOTSZ = AUDIO_SAMPSZ * 4 + STREAM_PRESZ,
+};
+
+
+/**
+ * Multicast packet pool
+ *
+ * Fixed set of preallocated mbufs recycled through the receive and
+ * player hot path. A slot is busy while anyone besides the pool holds
+ * a reference, so returning a buffer is a plain mem_deref by the user.
+ */
+static struct {
+	mtx_t lock;
+	struct mbuf **slotv;
+	uint32_t nslot;
+	uint32_t cursor;
+	uint32_t highwater;
+	uint64_t fallbacks;
+	bool inited;
+} pool;
+
+
+/**
+ * Allocate a packet buffer from the pool
+ *
+ * Falls back to a plain mbuf allocation if the pool is disabled, all
+ * slots are busy or the requested size does not fit a slot. The caller
+ * returns the buffer with mem_deref as usual.
+ *
+ * @param size Requested buffer size
+ *
+ * @return struct mbuf* or NULL if no memory
+ */
+struct mbuf *mcpool_buf_alloc(size_t size)
+{
+	struct mbuf *mb = NULL;
+	uint32_t i;
+
+	if (!pool.inited || !pool.nslot || size > POOL_SLOTSZ)
+		goto fallback;
+
+	mtx_lock(&pool.lock);
+	for (i = 0; i < pool.nslot; i++) {
+		uint32_t idx = (pool.cursor + i) % pool.nslot;
+
+		if (!pool.slotv[idx]) {
+			pool.slotv[idx] = mbuf_alloc(POOL_SLOTSZ);
+			if (!pool.slotv[idx])
+				break;
+		}
+		else if (mem_nrefs(pool.slotv[idx]) > 1)
+			continue;
+
+		mb = mem_ref(pool.slotv[idx]);
+		mb->pos = mb->end = 0;
+		pool.cursor = (idx + 1) % pool.nslot;
+		break;
+	}
+
+	if (mb) {
+		uint32_t busy = 0;
+
+		for (i = 0; i < pool.nslot; i++) {
+			if (pool.slotv[i] && mem_nrefs(pool.slotv[i]) > 1)
+				++busy;
+		}
+
+		if (busy > pool.highwater)
+			pool.highwater = busy;
+	}
+
+	mtx_unlock(&pool.lock);
+
+	if (mb)
+		return mb;
+
+  fallback:
+	if (pool.inited) {
+		mtx_lock(&pool.lock);
+		++pool.fallbacks;
+		mtx_unlock(&pool.lock);
+	}
+
+	return mbuf_alloc(size);
+}
+
+
+/**
+ * Print pool occupancy and high-water mark
+ *
+ * @param pf Printer
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcpool_print(struct re_printf *pf)
+{
+	uint32_t busy = 0;
+	uint32_t alloced = 0;
+	uint32_t i;
+	int err;
+
+	if (!pool.inited)
+		return re_hprintf(pf, "Multicast Pool: disabled\n");
+
+	mtx_lock(&pool.lock);
+	for (i = 0; i < pool.nslot; i++) {
+		if (!pool.slotv[i])
+			continue;
+
+		++alloced;
+		if (mem_nrefs(pool.slotv[i]) > 1)
+			++busy;
+	}
+
+	err = re_hprintf(pf, "Multicast Pool:\n"
+		"   slots=%u alloced=%u busy=%u highwater=%u slotsz=%u"
+		" fallbacks=%llu\n",
+		pool.nslot, alloced, busy, pool.highwater,
+		(uint32_t)POOL_SLOTSZ, pool.fallbacks);
+	mtx_unlock(&pool.lock);
+
+	return err;
+}
+
+
+/**
+ * Initialize the packet pool
+ *
+ * The number of slots is configured with multicast_pool_size, a value
+ * of 0 disables pooling and every allocation falls back to the heap.
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcpool_init(void)
+{
+	uint32_t nslot = POOL_DEFSZ;
+	int err;
+
+	(void)conf_get_u32(conf_cur(), "multicast_pool_size", &nslot);
+	if (!nslot)
+		return 0;
+
+	if (nslot > POOL_MAXSZ)
+		nslot = POOL_MAXSZ;
+
+	err = mtx_init(&pool.lock, mtx_plain) != thrd_success;
+	if (err)
+		return ENOMEM;
+
+	pool.slotv = mem_zalloc(nslot * sizeof(*pool.slotv), NULL);
+	if (!pool.slotv) {
+		mtx_destroy(&pool.lock);
+		return ENOMEM;
+	}
+
+	pool.nslot = nslot;
+	pool.inited = true;
+
+	return 0;
+}
+
+
+/**
+ * Terminate the packet pool and release all idle slots
+ */
+void mcpool_terminate(void)
+{
+	uint32_t i;
+
+	if (!pool.inited)
+		return;
+
+	mtx_lock(&pool.lock);
+	for (i = 0; i < pool.nslot; i++)
+		pool.slotv[i] = mem_deref(pool.slotv[i]);
+
+	pool.slotv = mem_deref(pool.slotv);
+	pool.nslot = 0;
+	mtx_unlock(&pool.lock);
+
+	pool.inited = false;
+	mtx_destroy(&pool.lock);
+}
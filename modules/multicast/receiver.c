@@ -4,6 +4,7 @@
  * Copyright (C) 2021 Commend.com - c.huber@commend.com
  */
 
+#include <re_atomic.h>
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -18,9 +19,33 @@
 struct list mcreceivl = LIST_INIT;
 static mtx_t mcreceivl_lock;
 
+/* Receiver lookup by priority in O(1). Slot 0 is unused since priority
+ * 0 is not allowed. The cached running receiver avoids scanning the
+ * list on every packet during arbitration. */
+static struct mcreceiver *mcprio_idx[256];
+static struct mcreceiver *mcrunning;
+
+/* With the receive engine the RTP packets arrive on worker threads
+ * which must not touch the player singleton or the UA/event layer.
+ * Such arbitration work is marshalled to the re main thread. */
+static struct mqueue *mcworkq;
+
+enum mcwork_id {
+	MCWORK_PLAYER_START,
+	MCWORK_PLAYER_STOP,
+	MCWORK_FADEIN,
+	MCWORK_CALLPRIO,
+	MCWORK_EVENT_START,
+	MCWORK_EVENT_RESTART,
+	MCWORK_EVENT_STOP,
+};
+
 
 enum {
 	TIMEOUT = 1000,
+
+	ADAPT_INTERVAL = 2000,  /* Latency controller period in [ms]    */
+	ADAPT_CLEAN    = 15,    /* Clean periods before shrinking again */
 };
 
 enum state {
@@ -39,18 +64,40 @@ struct mcreceiver {
 	struct le le;
 	struct sa addr;
 	uint8_t prio;
+	mtx_t lock;
 
 	struct udp_sock *rtp;
 	uint32_t ssrc;
 	struct jbuf *jbuf;
+	struct range jbuf_del;
+	enum jbuf_type jbtype;
+
+	struct {
+		bool en;
+		uint32_t cur;
+		uint32_t late_prev;
+		uint32_t under_prev;
+		uint32_t clean;
+		struct tmr tmr;
+	} adapt;
 
 	const struct aucodec *ac;
 
 	struct tmr timeout;
+	RE_ATOMIC uint64_t last_rx;
 
 	enum state state;
 	bool muted;
 	bool enable;
+
+	struct {
+		RE_ATOMIC uint64_t n_packets;
+		RE_ATOMIC uint64_t n_bytes;
+		RE_ATOMIC uint64_t n_lost;
+		RE_ATOMIC uint64_t n_discard;
+		uint16_t seq_last;
+		bool seq_init;
+	} stats;
 };
 
 
@@ -73,19 +120,56 @@ static char* state_str(enum state s) {
 }
 
 
+/**
+ * Lookup a multicast receiver by priority
+ *
+ * @param prio Priority
+ *
+ * @return struct mcreceiver* or NULL if not found
+ */
+static struct mcreceiver *prio_lookup(uint32_t prio)
+{
+	if (!prio || prio > 255)
+		return NULL;
+
+	return mcprio_idx[prio];
+}
+
+
+/**
+ * Clear the running receiver cache if it points to the given receiver
+ *
+ * @param mcreceiver Multicast receiver object
+ */
+static void running_clear(struct mcreceiver *mcreceiver)
+{
+	if (mcrunning == mcreceiver)
+		mcrunning = NULL;
+}
+
+
 static void mcreceiver_destructor(void *arg)
 {
 	struct mcreceiver *mcreceiver = arg;
 
 	tmr_cancel(&mcreceiver->timeout);
+	tmr_cancel(&mcreceiver->adapt.tmr);
+
+	running_clear(mcreceiver);
+	if (mcprio_idx[mcreceiver->prio] == mcreceiver)
+		mcprio_idx[mcreceiver->prio] = NULL;
 
 	if (mcreceiver->state == RUNNING)
 		mcplayer_stop();
 
 	mcreceiver->ssrc = 0;
 
+	if (mcrxengine_enabled())
+		mcrxengine_detach(mcreceiver->rtp);
+
 	mcreceiver->rtp  = mem_deref(mcreceiver->rtp);
 	mcreceiver->jbuf = mem_deref(mcreceiver->jbuf);
+	mtx_destroy(&mcreceiver->lock);
 }
 
 
@@ -107,42 +191,6 @@ static bool mcreceiver_addr_cmp(struct le *le, void *arg)
 }
 
 
-/**
- * Multicast receiver priority comparison
- *
- * @param le  List element (mcreceiver)
- * @param arg Argument     (priority)
- *
- * @return true if mcreceiver->prio == prio
- * @return false if mcreceiver->prio != prio
- */
-static bool mcreceiver_prio_cmp(struct le *le, void *arg)
-{
-	struct mcreceiver *mcreceiver = le->data;
-	uint32_t *prio = (uint32_t *)arg;
-
-	return mcreceiver->prio == *prio;
-}
-
-
-/**
- * Get running multicast receiver
- *
- * @param le  Multicast receiver list element
- * @param arg Unused
- *
- * @return true if multicast receiver is running
- * @return false if multicast receiver is not running
- */
-static bool mcreceiver_running(struct le *le, void *arg)
-{
-	struct mcreceiver *mcreceiver = le->data;
-	(void) arg;
-
-	return mcreceiver->state == RUNNING;
-}
-
-
 /**
  * Convert std rtp codec payload type to audio codec
  *
@@ -184,15 +232,9 @@ static const struct aucodec *pt2codec(const struct rtp_header *hdr)
 static void resume_uag_state(void)
 {
 	uint8_t h = 255;
-	struct le *le= NULL;
-	struct mcreceiver *mcreceiver = NULL;
 
-	for (le = list_head(&mcreceivl); le; le = le->next) {
-		mcreceiver = le->data;
-
-		if (mcreceiver->state == RUNNING && mcreceiver->prio < h)
-			h = mcreceiver->prio;
-	}
+	if (mcrunning)
+		h = mcrunning->prio;
 
 	if (h > multicast_callprio()) {
 		multicast_set_dnd(false);
@@ -202,15 +244,172 @@ static void resume_uag_state(void)
 }
 
 
+/**
+ * Hold or hangup ongoing calls for a high priority multicast
+ *
+ * Must be called from the re main thread
+ */
+static void callprio_hold(void)
+{
+	struct le *leua;
+	struct ua *ua;
+
+	multicast_set_dnd(true);
+	uag_set_nodial(true);
+
+	for (leua = list_head(uag_list()); leua; leua = leua->next) {
+		struct le *lecall;
+		ua = leua->data;
+		lecall = list_head(ua_calls(ua));
+		while (lecall) {
+			struct call *call = lecall->data;
+			lecall = lecall->next;
+
+			if (call_state(call) != CALL_STATE_ESTABLISHED) {
+				ua_hangup(ua, call, 0, NULL);
+				continue;
+			}
+
+			if (!call_is_onhold(call))
+				call_hold(call, true);
+		}
+	}
+}
+
+
+/**
+ * Execute deferred arbitration work on the re main thread
+ *
+ * The player operations are done under the receiver lock, which
+ * serializes them against the decode path of the receive workers.
+ *
+ * @param id         Work identifier
+ * @param mcreceiver Multicast receiver object (NULL for MCWORK_CALLPRIO)
+ */
+static void mcwork_exec(enum mcwork_id id, struct mcreceiver *mcreceiver)
+{
+	int err;
+
+	switch (id) {
+		case MCWORK_PLAYER_START:
+			mtx_lock(&mcreceiver->lock);
+			mcplayer_fadeout();
+			err = mcplayer_start(mcreceiver->ac);
+			mtx_unlock(&mcreceiver->lock);
+			if (err)
+				warning ("multicast receiver: player start "
+					"failed %J (%m)\n",
+					&mcreceiver->addr, err);
+			break;
+
+		case MCWORK_PLAYER_STOP:
+			mtx_lock(&mcreceiver->lock);
+			mcplayer_stop();
+			mtx_unlock(&mcreceiver->lock);
+			break;
+
+		case MCWORK_FADEIN:
+			mtx_lock(&mcreceiver->lock);
+			mcplayer_fadein(true);
+			mtx_unlock(&mcreceiver->lock);
+			break;
+
+		case MCWORK_CALLPRIO:
+			callprio_hold();
+			break;
+
+		case MCWORK_EVENT_START:
+			module_event("multicast", "receiver start", NULL,
+				NULL, "addr=%J prio=%d enabled=%d state=%s",
+				&mcreceiver->addr, mcreceiver->prio,
+				mcreceiver->enable,
+				state_str(mcreceiver->state));
+			break;
+
+		case MCWORK_EVENT_RESTART:
+			module_event("multicast", "receiver restart", NULL,
+				NULL, "addr=%J prio=%d enabled=%d state=%s",
+				&mcreceiver->addr, mcreceiver->prio,
+				mcreceiver->enable,
+				state_str(mcreceiver->state));
+			break;
+
+		case MCWORK_EVENT_STOP:
+			module_event("multicast",
+				"receiver stopped playing", NULL, NULL,
+				"addr=%J prio=%d enabled=%d state=%s",
+				&mcreceiver->addr, mcreceiver->prio,
+				mcreceiver->enable,
+				state_str(mcreceiver->state));
+			break;
+	}
+}
+
+
+static void mcwork_handler(int id, void *data, void *arg)
+{
+	struct mcreceiver *mcreceiver = data;
+	(void)arg;
+
+	mcwork_exec((enum mcwork_id)id, mcreceiver);
+	mem_deref(mcreceiver);
+}
+
+
+/**
+ * Marshal arbitration work to the re main thread
+ *
+ * @param id         Work identifier
+ * @param mcreceiver Multicast receiver object (NULL for MCWORK_CALLPRIO)
+ *
+ * @return int 0 if success, errorcode otherwise
+ */
+static int mcwork_defer(enum mcwork_id id, struct mcreceiver *mcreceiver)
+{
+	int err;
+
+	err = mqueue_push(mcworkq, id, mcreceiver ?
+		mem_ref(mcreceiver) : NULL);
+	if (err && mcreceiver)
+		mem_deref(mcreceiver);
+
+	return err;
+}
+
+
+/**
+ * Run or defer arbitration work depending on the calling thread
+ *
+ * @param id         Work identifier
+ * @param mcreceiver Multicast receiver object (NULL for MCWORK_CALLPRIO)
+ */
+static void mcwork(enum mcwork_id id, struct mcreceiver *mcreceiver)
+{
+	if (mcrxengine_enabled()) {
+		(void)mcwork_defer(id, mcreceiver);
+		return;
+	}
+
+	mcwork_exec(id, mcreceiver);
+}
+
+
 /**
  * Stops, flush, start player
  *
+ * With the receive engine the player restart is deferred to the re main
+ * thread, a few packets may be decoded against the previous player
+ * until the restart has run.
+ *
  * @param mcreceiver Multicast receiver object
  *
  * @return int 0 if success, errorcode otherwise
  */
 static int player_stop_start(struct mcreceiver *mcreceiver)
 {
+	if (mcrxengine_enabled())
+		return mcwork_defer(MCWORK_PLAYER_START, mcreceiver);
+
 	mcplayer_fadeout();
 	return mcplayer_start(mcreceiver->ac);
 }
@@ -218,16 +417,13 @@ static int player_stop_start(struct mcreceiver *mcreceiver)
 
 static void mcreceiver_stop(struct mcreceiver *mcreceiver)
 {
+	mtx_lock(&mcreceiver->lock);
 	mcreceiver->state = RECEIVING;
-
-	module_event("multicast",
-		     "receiver stopped playing", NULL, NULL,
-		     "addr=%J prio=%d enabled=%d state=%s",
-		     &mcreceiver->addr, mcreceiver->prio,
-		     mcreceiver->enable,
-		     state_str(mcreceiver->state));
-
+	running_clear(mcreceiver);
 	jbuf_flush(mcreceiver->jbuf);
+	mtx_unlock(&mcreceiver->lock);
+
+	mcwork(MCWORK_EVENT_STOP, mcreceiver);
 }
 
 
@@ -242,12 +438,18 @@ static void mcreceiver_stop(struct mcreceiver *mcreceiver)
 static int prio_handling(struct mcreceiver *mcreceiver, uint32_t ssrc)
 {
 	int err = 0;
-	struct le *le;
 	struct mcreceiver *hprio = NULL;
 
 	if (!mcreceiver)
 		return EINVAL;
 
+	/* Fast path: the stream keeps running, no arbitration needed and
+	 * the global lock is not taken on this packet */
+	if (mcreceiver->state == RUNNING && mcreceiver->enable &&
+	    mcreceiver->ssrc == ssrc &&
+	    !(mcreceiver->prio >= multicast_callprio() && uag_call_count()))
+		return 0;
+
 	err = mtx_trylock(&mcreceivl_lock) != thrd_success;
 	if (err)
 		return ENOMEM;
@@ -259,11 +461,7 @@ static int prio_handling(struct mcreceiver *mcreceiver, uint32_t ssrc)
 			"state=%s\n", &mcreceiver->addr, mcreceiver->prio,
 			mcreceiver->enable, state_str(mcreceiver->state));
 
-		module_event("multicast", "receiver start", NULL, NULL,
-			"addr=%J prio=%d enabled=%d state=%s",
-			&mcreceiver->addr, mcreceiver->prio,
-			mcreceiver->enable, state_str(mcreceiver->state));
-
+		mcwork(MCWORK_EVENT_START, mcreceiver);
 	}
 
 	if (!mcreceiver->enable) {
@@ -280,59 +478,33 @@ static int prio_handling(struct mcreceiver *mcreceiver, uint32_t ssrc)
 	if (mcreceiver->prio >= multicast_callprio() && uag_call_count()) {
 		if (mcreceiver->state == RUNNING) {
 			mcreceiver_stop(mcreceiver);
-			mcplayer_stop();
+			mcwork(MCWORK_PLAYER_STOP, mcreceiver);
 		}
 		goto out;
 	}
 	else if (mcreceiver->prio < multicast_callprio()) {
-		struct le *leua;
-		struct ua *ua;
-
-		multicast_set_dnd(true);
-		uag_set_nodial(true);
-
-		for (leua = list_head(uag_list()); leua; leua = leua->next) {
-			struct le *lecall;
-			ua = leua->data;
-			lecall = list_head(ua_calls(ua));
-			while (lecall) {
-				struct call *call = lecall->data;
-				lecall = lecall->next;
-
-				if (call_state(call) !=
-					CALL_STATE_ESTABLISHED) {
-					ua_hangup(ua, call, 0, NULL);
-					continue;
-				}
-
-				if (!call_is_onhold(call))
-					call_hold(call, true);
-			}
-		}
+		mcwork(MCWORK_CALLPRIO, NULL);
 	}
 
-	le = list_apply(&mcreceivl, true, mcreceiver_running, NULL);
-	if (!le) {
+	hprio = mcrunning;
+	if (!hprio) {
 		err = player_stop_start(mcreceiver);
 		if (err)
 			goto out;
 
 		mcreceiver->state = RUNNING;
+		mcrunning = mcreceiver;
 		mcreceiver->ssrc = ssrc;
 
 		info ("multicast receiver: start addr=%J prio=%d enabled=%d "
 			"state=%s\n", &mcreceiver->addr, mcreceiver->prio,
 			mcreceiver->enable, state_str(mcreceiver->state));
 
-		module_event("multicast", "receiver start", NULL, NULL,
-			"addr=%J prio=%d enabled=%d state=%s",
-			&mcreceiver->addr, mcreceiver->prio,
-			mcreceiver->enable, state_str(mcreceiver->state));
+		mcwork(MCWORK_EVENT_START, mcreceiver);
 
 		goto out;
 	}
 
-	hprio = le->data;
 	if (hprio->prio < mcreceiver->prio) {
 		goto out;
 	}
@@ -341,17 +513,14 @@ static int prio_handling(struct mcreceiver *mcreceiver, uint32_t ssrc)
 		if (hprio->state == IGNORED)
 			hprio->state = RUNNING;
 
-		mcplayer_fadein(true);
+		mcwork(MCWORK_FADEIN, mcreceiver);
 		mcreceiver->ssrc = ssrc;
 
 		info ("multicast receiver: restart addr=%J prio=%d enabled=%d "
 			"state=%s\n", &mcreceiver->addr, mcreceiver->prio,
 			mcreceiver->enable, state_str(mcreceiver->state));
 
-		module_event("multicast", "receiver restart", NULL, NULL,
-			"addr=%J prio=%d enabled=%d state=%s",
-			&mcreceiver->addr, mcreceiver->prio,
-			mcreceiver->enable, state_str(mcreceiver->state));
+		mcwork(MCWORK_EVENT_RESTART, mcreceiver);
 
 		goto out;
 	}
@@ -359,13 +528,22 @@ static int prio_handling(struct mcreceiver *mcreceiver, uint32_t ssrc)
 		goto out;
 	}
 
+	/* The receive worker of hprio decodes under its receiver lock,
+	 * demoting it under the same lock keeps its state and jbuf
+	 * consistent and makes the demotion visible before the deferred
+	 * player restart runs */
+	mtx_lock(&hprio->lock);
+	hprio->state = RECEIVING;
+	running_clear(hprio);
+	jbuf_flush(hprio->jbuf);
+	mtx_unlock(&hprio->lock);
+
 	err = player_stop_start(mcreceiver);
 	if (err)
 		goto out;
 
-	hprio->state = RECEIVING;
-	jbuf_flush(hprio->jbuf);
 	mcreceiver->state = RUNNING;
+	mcrunning = mcreceiver;
 	mcreceiver->ssrc = ssrc;
 
 
@@ -373,10 +551,7 @@ static int prio_handling(struct mcreceiver *mcreceiver, uint32_t ssrc)
 		"state=%s\n", &mcreceiver->addr, mcreceiver->prio,
 		mcreceiver->enable, state_str(mcreceiver->state));
 
-	module_event("multicast", "receiver start", NULL, NULL,
-		"addr=%J prio=%d enabled=%d state=%s",
-		&mcreceiver->addr, mcreceiver->prio, mcreceiver->enable,
-		state_str(mcreceiver->state));
+	mcwork(MCWORK_EVENT_START, mcreceiver);
 
   out:
 	mtx_unlock(&mcreceivl_lock);
@@ -402,22 +577,138 @@ static void timeout_handler(void *arg)
 		state_str(mcreceiver->state));
 
 	mtx_lock(&mcreceivl_lock);
+	mtx_lock(&mcreceiver->lock);
 	if (mcreceiver->state == RUNNING) {
 		mcplayer_stop();
 		jbuf_flush(mcreceiver->jbuf);
 	}
 
 	mcreceiver->state = LISTENING;
+	running_clear(mcreceiver);
 	mcreceiver->muted = false;
 	mcreceiver->ssrc = 0;
 	mcreceiver->ac   = 0;
 	resume_uag_state();
 
+	mtx_unlock(&mcreceiver->lock);
 	mtx_unlock(&mcreceivl_lock);
 	return;
 }
 
 
+/**
+ * Rebuild the jbuf of a receiver with a new minimum latency
+ *
+ * Must be called with the receiver lock held
+ *
+ * @param mcreceiver Multicast receiver object
+ * @param min        New minimum latency in frames
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int jbuf_rebuild(struct mcreceiver *mcreceiver, uint32_t min)
+{
+	struct jbuf *jb = NULL;
+	int err;
+
+	err = jbuf_alloc(&jb, min, mcreceiver->jbuf_del.max);
+	err |= jbuf_set_type(jb, mcreceiver->jbtype);
+	if (err) {
+		mem_deref(jb);
+		return err;
+	}
+
+	mem_deref(mcreceiver->jbuf);
+	mcreceiver->jbuf = jb;
+	mcreceiver->adapt.cur = min;
+	mcreceiver->adapt.late_prev = 0;
+	mcreceiver->adapt.under_prev = 0;
+
+	return 0;
+}
+
+
+/**
+ * Adaptive jitter-buffer latency controller
+ *
+ * Periodically samples the jbuf statistics of this group. Late packets
+ * or underflows grow the minimum latency one frame towards the
+ * configured maximum, a long clean period shrinks it back towards the
+ * configured minimum. Each receiver adapts independently.
+ *
+ * @param arg Multicast receiver object
+ */
+static void adapt_handler(void *arg)
+{
+	struct mcreceiver *mcreceiver = arg;
+	struct jbuf_stat stat;
+	uint32_t late, under;
+	uint32_t min = 0;
+	bool change = false;
+
+	mtx_lock(&mcreceiver->lock);
+	if (!mcreceiver->jbuf || jbuf_stats(mcreceiver->jbuf, &stat))
+		goto out;
+
+	late  = stat.n_late - mcreceiver->adapt.late_prev;
+	under = stat.n_underflow - mcreceiver->adapt.under_prev;
+	mcreceiver->adapt.late_prev  = stat.n_late;
+	mcreceiver->adapt.under_prev = stat.n_underflow;
+
+	if (late || under) {
+		mcreceiver->adapt.clean = 0;
+		if (mcreceiver->adapt.cur < mcreceiver->jbuf_del.max) {
+			min = mcreceiver->adapt.cur + 1;
+			change = true;
+		}
+	}
+	else if (++mcreceiver->adapt.clean >= ADAPT_CLEAN) {
+		mcreceiver->adapt.clean = 0;
+		if (mcreceiver->adapt.cur > mcreceiver->jbuf_del.min) {
+			min = mcreceiver->adapt.cur - 1;
+			change = true;
+		}
+	}
+
+	if (change) {
+		if (!jbuf_rebuild(mcreceiver, min))
+			info ("multicast receiver: addr=%J jbuf latency "
+				"-> %u frames (late=%u underflow=%u)\n",
+				&mcreceiver->addr, min, late, under);
+	}
+
+  out:
+	mtx_unlock(&mcreceiver->lock);
+	tmr_start(&mcreceiver->adapt.tmr, ADAPT_INTERVAL, adapt_handler,
+		mcreceiver);
+}
+
+
+/**
+ * Periodic RTP timeout watchdog for the receive engine
+ *
+ * With the receive engine the RTP packets arrive on worker threads
+ * where the timeout timer must not be restarted. The workers only
+ * update last_rx and this main thread timer detects the EOS.
+ *
+ * @param arg Multicast receiver object
+ */
+static void watch_handler(void *arg)
+{
+	struct mcreceiver *mcreceiver = arg;
+	uint64_t last = re_atomic_rlx(&mcreceiver->last_rx);
+
+	if (mcreceiver->state != LISTENING && last &&
+	    tmr_jiffies() - last >= TIMEOUT) {
+		re_atomic_rlx_set(&mcreceiver->last_rx, 0);
+		timeout_handler(mcreceiver);
+	}
+
+	tmr_start(&mcreceiver->timeout, TIMEOUT / 2, watch_handler,
+		mcreceiver);
+}
+
+
 /**
  * Decode RTP packet
  *
@@ -460,35 +751,70 @@ static void rtp_handler(const struct sa *src, const struct rtp_header *hdr,
 	(void) src;
 	(void) mb;
 
+	re_atomic_rlx_add(&mcreceiver->stats.n_packets, 1);
+	re_atomic_rlx_add(&mcreceiver->stats.n_bytes, mbuf_get_left(mb));
+
+	/* seq state is only touched on the receive path of this group */
+	if (mcreceiver->stats.seq_init) {
+		int16_t gap = (int16_t)(hdr->seq -
+			mcreceiver->stats.seq_last - 1);
+
+		if (gap > 0)
+			re_atomic_rlx_add(&mcreceiver->stats.n_lost,
+				(uint16_t)gap);
+	}
+
+	mcreceiver->stats.seq_last = hdr->seq;
+	mcreceiver->stats.seq_init = true;
+
 	mcreceiver->ac = pt2codec(hdr);
-	if (!mcreceiver->ac)
+	if (!mcreceiver->ac) {
+		re_atomic_rlx_add(&mcreceiver->stats.n_discard, 1);
 		goto out;
+	}
 
 	if (!mbuf_get_left(mb))
 		goto out;
 
 	err = prio_handling(mcreceiver, hdr->ssrc);
-	if (err)
+	if (err) {
+		re_atomic_rlx_add(&mcreceiver->stats.n_discard, 1);
 		goto out;
+	}
 
+	mtx_lock(&mcreceiver->lock);
 	if (mcreceiver->state == RUNNING) {
 		if (mcreceiver->muted && mcplayer_fadeout_done()) {
-			mcplayer_stop();
+			if (mcrxengine_enabled())
+				(void)mcwork_defer(MCWORK_PLAYER_STOP,
+					mcreceiver);
+			else
+				mcplayer_stop();
+
 			jbuf_flush(mcreceiver->jbuf);
+			mtx_unlock(&mcreceiver->lock);
 			goto out;
 		}
 
 		err = jbuf_put(mcreceiver->jbuf, hdr, mb);
-		if (err)
+		if (err) {
+			re_atomic_rlx_add(&mcreceiver->stats.n_discard, 1);
+			mtx_unlock(&mcreceiver->lock);
 			return;
+		}
 
 		if (player_decode(mcreceiver) == EAGAIN) {
 			(void) player_decode(mcreceiver);
 		}
 	}
+	mtx_unlock(&mcreceiver->lock);
 
   out:
-	tmr_start(&mcreceiver->timeout, TIMEOUT, timeout_handler, mcreceiver);
+	if (mcrxengine_enabled())
+		re_atomic_rlx_set(&mcreceiver->last_rx, tmr_jiffies());
+	else
+		tmr_start(&mcreceiver->timeout, TIMEOUT, timeout_handler,
+			mcreceiver);
 
 	return;
 }
@@ -631,13 +957,16 @@ int mcreceiver_chprio(struct sa *addr, uint32_t prio)
 	if (!addr || !prio)
 		return EINVAL;
 
+	if (prio > 255)
+		return EINVAL;
+
 	le = list_apply(&mcreceivl, true, mcreceiver_addr_cmp, addr);
 	if (!le) {
 		warning ("multicast receiver: receiver %J not found\n", addr);
 		return EINVAL;
 	}
 
-	if (list_apply(&mcreceivl, true, mcreceiver_prio_cmp, &prio)) {
+	if (prio_lookup(prio)) {
 		warning ("multicast receiver: priority %d already in use\n",
 			prio);
 		return EADDRINUSE;
@@ -645,7 +974,11 @@ int mcreceiver_chprio(struct sa *addr, uint32_t prio)
 
 	mcreceiver = le->data;
 	mtx_lock(&mcreceivl_lock);
+	if (mcprio_idx[mcreceiver->prio] == mcreceiver)
+		mcprio_idx[mcreceiver->prio] = NULL;
+
 	mcreceiver->prio = prio;
+	mcprio_idx[mcreceiver->prio] = mcreceiver;
 	mtx_unlock(&mcreceivl_lock);
 	resume_uag_state();
 	return 0;
@@ -661,27 +994,27 @@ int mcreceiver_chprio(struct sa *addr, uint32_t prio)
  */
 int mcreceiver_prioignore(uint32_t prio)
 {
-	struct le *le;
 	struct mcreceiver *mcreceiver;
 	int err = 0;
 
 	if (!prio)
 		return EINVAL;
 
-	le = list_apply(&mcreceivl, true, mcreceiver_prio_cmp, &prio);
-	if (!le) {
+	mcreceiver = prio_lookup(prio);
+	if (!mcreceiver) {
 		warning ("multicast receiver: priority %d not found\n", prio);
 		return EINVAL;
 	}
 
-	mcreceiver = le->data;
 	if (mcreceiver->state == IGNORED)
 		return 0;
 
 	mtx_lock(&mcreceivl_lock);
+	mtx_lock(&mcreceiver->lock);
 	switch (mcreceiver->state) {
 		case RUNNING:
 			mcreceiver->state = IGNORED;
+			running_clear(mcreceiver);
 			mcplayer_stop();
 			jbuf_flush(mcreceiver->jbuf);
 			break;
@@ -695,6 +1028,7 @@ int mcreceiver_prioignore(uint32_t prio)
 			break;
 	}
 
+	mtx_unlock(&mcreceiver->lock);
 	mtx_unlock(&mcreceivl_lock);
 	resume_uag_state();
 	return err;
@@ -710,21 +1044,21 @@ int mcreceiver_prioignore(uint32_t prio)
  */
 int mcreceiver_mute(uint32_t prio)
 {
-	struct le *le;
 	struct mcreceiver *mcreceiver;
 	int err = 0;
 
 	if (!prio)
 		return EINVAL;
 
-	le = list_apply(&mcreceivl, true, mcreceiver_prio_cmp, &prio);
-	if (!le) {
+	mcreceiver = prio_lookup(prio);
+	if (!mcreceiver) {
 		warning ("multicast receiver: priority %d not found\n", prio);
 		return EINVAL;
 	}
 
-	mcreceiver = le->data;
-	mtx_lock(&mcreceivl_lock);
+	/* only per-receiver state is touched, the global lock and with it
+	 * the other receive paths are left alone */
+	mtx_lock(&mcreceiver->lock);
 	mcreceiver->muted = !mcreceiver->muted;
 	if (mcreceiver->state == RUNNING) {
 		if (mcreceiver->muted) {
@@ -737,7 +1071,7 @@ int mcreceiver_mute(uint32_t prio)
 				err = 0;
 		}
 	}
-	mtx_unlock(&mcreceivl_lock);
+	mtx_unlock(&mcreceiver->lock);
 	return err;
 }
 
@@ -751,6 +1085,7 @@ void mcreceiver_unregall(void)
 	list_flush(&mcreceivl);
 	mtx_unlock(&mcreceivl_lock);
 	resume_uag_state();
+	mcworkq = mem_deref(mcworkq);
 	mtx_destroy(&mcreceivl_lock);
 }
 
@@ -777,8 +1112,10 @@ void mcreceiver_unreg(struct sa *addr){
 	mem_deref(mcreceiver);
 	resume_uag_state();
 
-	if (list_isempty(&mcreceivl))
+	if (list_isempty(&mcreceivl)) {
+		mcworkq = mem_deref(mcworkq);
 		mtx_destroy(&mcreceivl_lock);
+	}
 }
 
 
@@ -809,7 +1146,7 @@ int mcreceiver_alloc(struct sa *addr, uint8_t prio)
 		return EADDRINUSE;
 	}
 
-	if (list_apply(&mcreceivl, true, mcreceiver_prio_cmp, &prio)) {
+	if (prio_lookup(prio)) {
 		warning ("multicast receiver: priority %d already in use\n",
 			prio);
 		return EADDRINUSE;
@@ -819,6 +1156,12 @@ int mcreceiver_alloc(struct sa *addr, uint8_t prio)
 	if (!mcreceiver)
 		return ENOMEM;
 
+	err = mtx_init(&mcreceiver->lock, mtx_plain) != thrd_success;
+	if (err) {
+		mem_deref(mcreceiver);
+		return ENOMEM;
+	}
+
 	if (list_isempty(&mcreceivl)) {
 		err = mtx_init(&mcreceivl_lock, mtx_plain) != thrd_success;
 		if (err) {
@@ -841,11 +1184,21 @@ int mcreceiver_alloc(struct sa *addr, uint8_t prio)
 	if (0 == conf_get(conf_cur(), "multicast_jbuf_type", &pl))
 		jbtype = conf_get_jbuf_type(&pl);
 
+	mcreceiver->jbuf_del = jbuf_del;
+	mcreceiver->jbtype = jbtype;
+	mcreceiver->adapt.cur = jbuf_del.min;
+	(void)conf_get_bool(conf_cur(), "multicast_jbuf_adapt",
+			    &mcreceiver->adapt.en);
+
 	err = jbuf_alloc(&mcreceiver->jbuf, jbuf_del.min, jbuf_del.max);
 	err |= jbuf_set_type(mcreceiver->jbuf, jbtype);
 	if (err)
 		goto out;
 
+	if (mcreceiver->adapt.en && jbtype != JBUF_OFF)
+		tmr_start(&mcreceiver->adapt.tmr, ADAPT_INTERVAL,
+			adapt_handler, mcreceiver);
+
 	err = udp_listen(&mcreceiver->rtp, &mcreceiver->addr,
 		rtp_handler_wrapper, mcreceiver);
 	if (err) {
@@ -870,8 +1223,28 @@ int mcreceiver_alloc(struct sa *addr, uint8_t prio)
 		}
 	}
 
+	if (mcrxengine_enabled()) {
+		if (!mcworkq) {
+			err = mqueue_alloc(&mcworkq, mcwork_handler, NULL);
+			if (err)
+				goto out;
+		}
+
+		err = mcrxengine_attach(mcreceiver->rtp, rtp_handler_wrapper,
+			mcreceiver);
+		if (err) {
+			warning ("multicast receiver: rxengine attach "
+				"failed %J (%m)\n", &mcreceiver->addr, err);
+			goto out;
+		}
+
+		tmr_start(&mcreceiver->timeout, TIMEOUT, watch_handler,
+			mcreceiver);
+	}
+
 	mtx_lock(&mcreceivl_lock);
 	list_append(&mcreceivl, &mcreceiver->le, mcreceiver);
+	mcprio_idx[mcreceiver->prio] = mcreceiver;
 	mtx_unlock(&mcreceivl_lock);
 
   out:
@@ -887,6 +1260,33 @@ int mcreceiver_alloc(struct sa *addr, uint8_t prio)
  *
  * @param pf Printer
  */
+/**
+ * Print RTP statistics of all multicast receiver
+ *
+ * The counters are updated lock-free on the receive path and read
+ * relaxed here, a snapshot during traffic may be slightly stale.
+ *
+ * @param pf Printer
+ */
+void mcreceiver_stats(struct re_printf *pf)
+{
+	struct le *le = NULL;
+	struct mcreceiver *mcreceiver = NULL;
+
+	re_hprintf(pf, "Multicast Receiver RTP Statistics:\n");
+	LIST_FOREACH(&mcreceivl, le) {
+		mcreceiver = le->data;
+		re_hprintf(pf, "   addr=%J prio=%d packets=%llu bytes=%llu "
+			"lost=%llu discarded=%llu\n",
+			&mcreceiver->addr, mcreceiver->prio,
+			re_atomic_rlx(&mcreceiver->stats.n_packets),
+			re_atomic_rlx(&mcreceiver->stats.n_bytes),
+			re_atomic_rlx(&mcreceiver->stats.n_lost),
+			re_atomic_rlx(&mcreceiver->stats.n_discard));
+	}
+}
+
+
 void mcreceiver_print(struct re_printf *pf)
 {
 	struct le *le = NULL;
@@ -0,0 +1,449 @@
+/**
+ * @file rxengine.c  Multicast receive thread pool
+ *
+ * Copyright (C) 2021 Commend.com - c.huber@commend.com
+ */
+
+#include <re_atomic.h>
+#include <re.h>
+#include <baresip.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#endif
+
+#include "multicast.h"
+
+#define DEBUG_MODULE "mcrxengine"
+#define DEBUG_LEVEL 6
+#include <re_dbg.h>
+
+
+enum {
+	RX_BATCH    = 16,     /* Maximum datagrams read per syscall     */
+	RX_SIZE     = 8192,   /* Receive buffer size per datagram       */
+	MAX_WORKERS = 8,      /* Upper bound for multicast_rx_threads   */
+};
+
+
+/**
+ * Multicast receive socket entry
+ *
+ * Binds one receiver socket to the worker that drains it. A socket is
+ * always served by exactly one worker, which keeps the packet order per
+ * multicast group intact without extra locking.
+ */
+struct rxsock {
+	struct le le;
+	struct udp_sock *us;
+	re_sock_t fd;
+	udp_recv_h *rxh;
+	void *arg;
+};
+
+
+/**
+ * Multicast receive worker
+ *
+ * One polling thread draining all sockets assigned to it
+ */
+struct rxworker {
+	thrd_t tid;
+	RE_ATOMIC bool run;
+	mtx_t lock;
+	struct list sockl;
+	uint32_t nsock;
+	re_sock_t wakefd[2];
+};
+
+
+static struct {
+	struct rxworker workerv[MAX_WORKERS];
+	uint32_t nworker;
+} rxengine;
+
+
+#ifndef WIN32
+/**
+ * Drain one socket with batched reads
+ *
+ * Freshly allocated mbufs are handed to the receive handler, which may
+ * keep a reference (e.g. jbuf), therefore the buffers are not recycled
+ * here.
+ *
+ * @param rxs Receive socket entry
+ */
+static void rxsock_drain(struct rxsock *rxs)
+{
+	struct mbuf *mbv[RX_BATCH];
+	struct sa srcv[RX_BATCH];
+	int i, n;
+
+#ifdef __linux__
+	struct mmsghdr msgv[RX_BATCH];
+	struct iovec iov[RX_BATCH];
+
+	for (;;) {
+		memset(msgv, 0, sizeof(msgv));
+		for (i = 0; i < RX_BATCH; i++) {
+			mbv[i] = mcpool_buf_alloc(RX_SIZE);
+			if (!mbv[i]) {
+				while (i--)
+					mem_deref(mbv[i]);
+				return;
+			}
+
+			iov[i].iov_base = mbv[i]->buf;
+			iov[i].iov_len  = mbv[i]->size;
+			sa_init(&srcv[i], AF_UNSPEC);
+			msgv[i].msg_hdr.msg_name    = &srcv[i].u.sa;
+			msgv[i].msg_hdr.msg_namelen = sizeof(srcv[i].u);
+			msgv[i].msg_hdr.msg_iov     = &iov[i];
+			msgv[i].msg_hdr.msg_iovlen  = 1;
+		}
+
+		n = recvmmsg(rxs->fd, msgv, RX_BATCH, 0, NULL);
+		if (n <= 0) {
+			for (i = 0; i < RX_BATCH; i++)
+				mem_deref(mbv[i]);
+			return;
+		}
+
+		for (i = 0; i < n; i++) {
+			srcv[i].len = msgv[i].msg_hdr.msg_namelen;
+			mbv[i]->pos = 0;
+			mbv[i]->end = msgv[i].msg_len;
+			rxs->rxh(&srcv[i], mbv[i], rxs->arg);
+			mem_deref(mbv[i]);
+		}
+
+		for (i = n; i < RX_BATCH; i++)
+			mem_deref(mbv[i]);
+
+		if (n < RX_BATCH)
+			return;
+	}
+#else
+	for (i = 0; i < RX_BATCH; i++) {
+		ssize_t len;
+		socklen_t slen;
+
+		mbv[0] = mcpool_buf_alloc(RX_SIZE);
+		if (!mbv[0])
+			return;
+
+		sa_init(&srcv[0], AF_UNSPEC);
+		slen = sizeof(srcv[0].u);
+		len = recvfrom(rxs->fd, (void *)mbv[0]->buf, mbv[0]->size, 0,
+			&srcv[0].u.sa, &slen);
+		if (len <= 0) {
+			mem_deref(mbv[0]);
+			return;
+		}
+
+		srcv[0].len = slen;
+		mbv[0]->pos = 0;
+		mbv[0]->end = (size_t)len;
+		rxs->rxh(&srcv[0], mbv[0], rxs->arg);
+		mem_deref(mbv[0]);
+	}
+
+	(void)n;
+#endif
+}
+
+
+/**
+ * Receive worker thread function
+ *
+ * @param arg Receive worker object
+ *
+ * @return 0
+ */
+static int rxworker_thread(void *arg)
+{
+	struct rxworker *worker = arg;
+	struct pollfd fds[1 + RX_BATCH * MAX_WORKERS];
+	struct rxsock *sockv[RX_BATCH * MAX_WORKERS];
+	struct le *le;
+	nfds_t nfds;
+	uint32_t i;
+	int n;
+
+	while (re_atomic_rlx(&worker->run)) {
+		nfds = 0;
+		fds[nfds].fd = worker->wakefd[0];
+		fds[nfds].events = POLLIN;
+		++nfds;
+
+		mtx_lock(&worker->lock);
+		LIST_FOREACH(&worker->sockl, le) {
+			struct rxsock *rxs = le->data;
+
+			if (nfds >= RE_ARRAY_SIZE(fds))
+				break;
+
+			sockv[nfds - 1] = rxs;
+			fds[nfds].fd = rxs->fd;
+			fds[nfds].events = POLLIN;
+			++nfds;
+		}
+		mtx_unlock(&worker->lock);
+
+		n = poll(fds, nfds, -1);
+		if (n <= 0)
+			continue;
+
+		if (fds[0].revents & POLLIN) {
+			uint8_t b;
+			while (read(worker->wakefd[0], &b, 1) > 0)
+				;
+		}
+
+		mtx_lock(&worker->lock);
+		for (i = 1; i < nfds; i++) {
+			if (!(fds[i].revents & POLLIN))
+				continue;
+
+			/* entry may be detached while polling */
+			if (!list_contains(&worker->sockl, &sockv[i - 1]->le))
+				continue;
+
+			rxsock_drain(sockv[i - 1]);
+		}
+		mtx_unlock(&worker->lock);
+	}
+
+	return 0;
+}
+
+
+/**
+ * Wake a worker so it picks up socket list changes
+ *
+ * @param worker Receive worker object
+ */
+static void rxworker_wakeup(struct rxworker *worker)
+{
+	uint8_t b = 0;
+	ssize_t n;
+
+	n = write(worker->wakefd[1], &b, 1);
+	(void)n;
+}
+
+
+/**
+ * Find the worker with the least number of assigned sockets
+ *
+ * @return struct rxworker*
+ */
+static struct rxworker *rxworker_least(void)
+{
+	struct rxworker *worker = &rxengine.workerv[0];
+	uint32_t i;
+
+	for (i = 1; i < rxengine.nworker; i++) {
+		if (rxengine.workerv[i].nsock < worker->nsock)
+			worker = &rxengine.workerv[i];
+	}
+
+	return worker;
+}
+#endif
+
+
+/**
+ * Check if the receive engine is active
+ *
+ * @return true if receive worker threads are running
+ */
+bool mcrxengine_enabled(void)
+{
+	return rxengine.nworker > 0;
+}
+
+
+/**
+ * Attach a receiver socket to the least loaded worker
+ *
+ * @note The socket is removed from the re main loop, all packets are
+ * read by the worker thread from now on. Must be called from the re
+ * main thread.
+ *
+ * @param us  UDP socket of the receiver
+ * @param rxh UDP receive handler
+ * @param arg Receive handler argument
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcrxengine_attach(struct udp_sock *us, udp_recv_h *rxh, void *arg)
+{
+#ifndef WIN32
+	struct rxworker *worker;
+	struct rxsock *rxs;
+	re_sock_t fd;
+
+	if (!us || !rxh)
+		return EINVAL;
+
+	if (!mcrxengine_enabled())
+		return EPERM;
+
+	fd = udp_sock_fd(us, AF_INET);
+	if (fd == RE_BAD_SOCK)
+		return EBADF;
+
+	rxs = mem_zalloc(sizeof(*rxs), NULL);
+	if (!rxs)
+		return ENOMEM;
+
+	rxs->us  = us;
+	rxs->fd  = fd;
+	rxs->rxh = rxh;
+	rxs->arg = arg;
+
+	fd_close(fd);
+
+	worker = rxworker_least();
+	mtx_lock(&worker->lock);
+	list_append(&worker->sockl, &rxs->le, rxs);
+	++worker->nsock;
+	mtx_unlock(&worker->lock);
+	rxworker_wakeup(worker);
+
+	return 0;
+#else
+	(void)us;
+	(void)rxh;
+	(void)arg;
+
+	return ENOTSUP;
+#endif
+}
+
+
+/**
+ * Detach a receiver socket from its worker
+ *
+ * @param us UDP socket of the receiver
+ */
+void mcrxengine_detach(struct udp_sock *us)
+{
+#ifndef WIN32
+	uint32_t i;
+
+	if (!us)
+		return;
+
+	for (i = 0; i < rxengine.nworker; i++) {
+		struct rxworker *worker = &rxengine.workerv[i];
+		struct le *le;
+
+		mtx_lock(&worker->lock);
+		LIST_FOREACH(&worker->sockl, le) {
+			struct rxsock *rxs = le->data;
+
+			if (rxs->us != us)
+				continue;
+
+			list_unlink(&rxs->le);
+			--worker->nsock;
+			mtx_unlock(&worker->lock);
+			rxworker_wakeup(worker);
+			mem_deref(rxs);
+			return;
+		}
+		mtx_unlock(&worker->lock);
+	}
+#else
+	(void)us;
+#endif
+}
+
+
+/**
+ * Initialize the receive engine worker threads
+ *
+ * Reads multicast_rx_threads from the config. A value of 0 (default)
+ * keeps the legacy single threaded receive path on the re main loop.
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int mcrxengine_init(void)
+{
+#ifndef WIN32
+	uint32_t nworker = 0;
+	uint32_t i;
+	int err = 0;
+
+	(void)conf_get_u32(conf_cur(), "multicast_rx_threads", &nworker);
+	if (!nworker)
+		return 0;
+
+	if (nworker > MAX_WORKERS)
+		nworker = MAX_WORKERS;
+
+	for (i = 0; i < nworker; i++) {
+		struct rxworker *worker = &rxengine.workerv[i];
+
+		err = mtx_init(&worker->lock, mtx_plain) != thrd_success;
+		if (err)
+			return ENOMEM;
+
+		if (pipe(worker->wakefd) < 0)
+			return errno;
+
+		err = net_sockopt_blocking_set(worker->wakefd[0], false);
+		if (err)
+			return err;
+
+		list_init(&worker->sockl);
+		re_atomic_rlx_set(&worker->run, true);
+		err = thread_create_name(&worker->tid, "mcrx",
+			rxworker_thread, worker);
+		if (err) {
+			re_atomic_rlx_set(&worker->run, false);
+			return err;
+		}
+
+		++rxengine.nworker;
+	}
+
+	info ("multicast rxengine: started %u receive worker\n",
+		rxengine.nworker);
+
+	return 0;
+#else
+	return 0;
+#endif
+}
+
+
+/**
+ * Terminate the receive engine and join all worker threads
+ */
+void mcrxengine_terminate(void)
+{
+#ifndef WIN32
+	uint32_t i;
+
+	for (i = 0; i < rxengine.nworker; i++) {
+		struct rxworker *worker = &rxengine.workerv[i];
+
+		re_atomic_rlx_set(&worker->run, false);
+		rxworker_wakeup(worker);
+		thrd_join(worker->tid, NULL);
+
+		list_flush(&worker->sockl);
+		worker->nsock = 0;
+		close(worker->wakefd[0]);
+		close(worker->wakefd[1]);
+		mtx_destroy(&worker->lock);
+	}
+
+	rxengine.nworker = 0;
+#endif
+}
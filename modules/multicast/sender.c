@@ -9,6 +9,9 @@
 #include <baresip.h>
 
 #include <stdlib.h>
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
 
 #include "multicast.h"
 
@@ -18,6 +21,27 @@
 
 
 static struct list mcsenderl = LIST_INIT;
+static struct list mcfanoutl = LIST_INIT;
+
+
+/**
+ * Multicast fan-out struct
+ *
+ * One shared audio source and encoder per codec. Every encoded frame
+ * is handed once to the fan-out which distributes it to all senders
+ * using that codec.
+ */
+struct mcfanout {
+	struct le le;
+
+	const struct aucodec *ac;
+	struct mcsource *src;
+	struct list senderl;
+
+	struct udp_sock *us;
+	int af;
+	bool batch;
+};
 
 
 /**
@@ -27,6 +51,7 @@ static struct list mcsenderl = LIST_INIT;
  */
 struct mcsender {
 	struct le le;
+	struct le fanle;
 
 	struct sa addr;
 	struct rtp_sock *rtp;
@@ -34,21 +59,61 @@ struct mcsender {
 	struct config_audio *cfg;
 	const struct aucodec *ac;
 
-	struct mcsource *src;
+	struct mcfanout *fan;
 	bool enable;
+
+	uint32_t ssrc;
+	uint16_t seq;
 };
 
 
+static void mcfanout_destructor(void *arg)
+{
+	struct mcfanout *fan = arg;
+
+	mcsource_stop(fan->src);
+	fan->src = mem_deref(fan->src);
+	fan->us  = mem_deref(fan->us);
+}
+
+
 static void mcsender_destructor(void *arg)
 {
 	struct mcsender *mcsender = arg;
+	struct mcfanout *fan = mcsender->fan;
+
+	list_unlink(&mcsender->fanle);
+	if (fan && list_isempty(&fan->senderl)) {
+		list_unlink(&fan->le);
+		mem_deref(fan);
+	}
 
-	mcsource_stop(mcsender->src);
-	mcsender->src = mem_deref(mcsender->src);
 	mcsender->rtp = mem_deref(mcsender->rtp);
 }
 
 
+/**
+ * Find the fan-out for a given audio codec
+ *
+ * @param ac Audio codec
+ *
+ * @return struct mcfanout* or NULL if not found
+ */
+static struct mcfanout *mcfanout_find(const struct aucodec *ac)
+{
+	struct le *le;
+
+	LIST_FOREACH(&mcfanoutl, le) {
+		struct mcfanout *fan = le->data;
+
+		if (fan->ac == ac)
+			return fan;
+	}
+
+	return NULL;
+}
+
+
 /**
  * Multicast address comparison
  *
@@ -67,6 +132,62 @@ static bool mcsender_addr_cmp(struct le *le, void *arg)
 }
 
 
+/**
+ * Encode the RTP header and send one datagram to a sender
+ *
+ * The header is written into the STREAM_PRESZ area in front of the
+ * shared payload and the mbuf position is restored afterwards. Both
+ * this and the batched path are driven by the same per-sender SSRC and
+ * sequence counters, so the on-wire stream stays continuous when the
+ * sender count crosses the batch threshold.
+ *
+ * @param mcsender Multicast sender object
+ * @param ext      RTP extension header flag
+ * @param marker   RTP marker
+ * @param rtp_ts   RTP timestamp
+ * @param mb       Data to send
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int mcsender_send(struct mcsender *mcsender, bool ext, bool marker,
+	uint32_t rtp_ts, struct mbuf *mb)
+{
+	struct rtp_header hdr;
+	struct pl placpt = PL_INIT;
+	size_t pos;
+	int err;
+
+	if (mb->pos < RTP_HEADER_SIZE)
+		return EBADMSG;
+
+	pl_set_str(&placpt, mcsender->ac->pt);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ver  = RTP_VERSION;
+	hdr.x    = ext;
+	hdr.m    = marker;
+	hdr.pt   = (uint8_t)pl_u32(&placpt);
+	hdr.seq  = mcsender->seq++;
+	hdr.ts   = rtp_ts;
+	hdr.ssrc = mcsender->ssrc;
+
+	pos = mb->pos;
+	mb->pos = pos - RTP_HEADER_SIZE;
+	err = rtp_hdr_encode(mb, &hdr);
+	if (err) {
+		mb->pos = pos;
+		return err;
+	}
+
+	mb->pos = pos - RTP_HEADER_SIZE;
+	err = udp_send((struct udp_sock *)rtp_sock(mcsender->rtp),
+		&mcsender->addr, mb);
+	mb->pos = pos;
+
+	return err;
+}
+
+
 /**
  * Multicast send handler
  *
@@ -80,8 +201,6 @@ static int mcsender_send_handler(size_t ext_len, bool marker,
 	uint32_t rtp_ts, struct mbuf *mb, void *arg)
 {
 	struct mcsender *mcsender = arg;
-	struct pl placpt = PL_INIT;
-	int err = 0;
 
 	if (!mb)
 		return EINVAL;
@@ -92,9 +211,152 @@ static int mcsender_send_handler(size_t ext_len, bool marker,
 	if (uag_call_count())
 		return 0;
 
-	pl_set_str(&placpt, mcsender->ac->pt);
-	err = rtp_send(mcsender->rtp, &mcsender->addr, ext_len != 0, marker,
-		pl_u32(&placpt), rtp_ts, tmr_jiffies_rt_usec(), mb);
+	return mcsender_send(mcsender, ext_len != 0, marker, rtp_ts, mb);
+}
+
+
+#ifdef __linux__
+enum {
+	TX_BATCH = 64,      /* Maximum datagrams sent per syscall */
+};
+
+
+/**
+ * Send one encoded frame to all senders in a single syscall
+ *
+ * Builds one RTP header per sender in front of the shared payload and
+ * hands all datagrams to the kernel with sendmmsg() on the fan-out
+ * socket. Senders whose address family does not match the socket fall
+ * back to the per-sender send path.
+ *
+ * @param fan    Multicast fan-out object
+ * @param marker RTP marker
+ * @param rtp_ts RTP timestamp
+ * @param mb     Encoded payload
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int mcfanout_send_batch(struct mcfanout *fan, bool marker,
+	uint32_t rtp_ts, struct mbuf *mb)
+{
+	struct mmsghdr msgv[TX_BATCH];
+	struct iovec iov[TX_BATCH][2];
+	uint8_t hdrv[TX_BATCH][RTP_HEADER_SIZE];
+	struct pl placpt = PL_INIT;
+	struct le *le;
+	re_sock_t fd;
+	unsigned n = 0;
+	int ferr = 0;
+	int err = 0;
+
+	fd = udp_sock_fd(fan->us, fan->af);
+	if (fd == RE_BAD_SOCK)
+		return EBADF;
+
+	pl_set_str(&placpt, fan->ac->pt);
+
+	memset(msgv, 0, sizeof(msgv));
+	LIST_FOREACH(&fan->senderl, le) {
+		struct mcsender *mcsender = le->data;
+		struct rtp_header hdr;
+		struct mbuf hmb;
+
+		if (!mcsender->enable)
+			continue;
+
+		/* the fan-out socket is bound to one address family,
+		 * senders of the other family use their own socket */
+		if (sa_af(&mcsender->addr) != fan->af) {
+			ferr |= mcsender_send(mcsender, false, marker,
+				rtp_ts, mb);
+			continue;
+		}
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.ver  = RTP_VERSION;
+		hdr.m    = marker;
+		hdr.pt   = (uint8_t)pl_u32(&placpt);
+		hdr.seq  = mcsender->seq++;
+		hdr.ts   = rtp_ts;
+		hdr.ssrc = mcsender->ssrc;
+
+		hmb.buf  = hdrv[n];
+		hmb.size = RTP_HEADER_SIZE;
+		hmb.pos  = 0;
+		hmb.end  = 0;
+
+		err = rtp_hdr_encode(&hmb, &hdr);
+		if (err)
+			return err;
+
+		iov[n][0].iov_base = hdrv[n];
+		iov[n][0].iov_len  = hmb.end;
+		iov[n][1].iov_base = mbuf_buf(mb);
+		iov[n][1].iov_len  = mbuf_get_left(mb);
+
+		msgv[n].msg_hdr.msg_name    = &mcsender->addr.u.sa;
+		msgv[n].msg_hdr.msg_namelen = mcsender->addr.len;
+		msgv[n].msg_hdr.msg_iov     = iov[n];
+		msgv[n].msg_hdr.msg_iovlen  = 2;
+
+		if (++n == TX_BATCH) {
+			if (sendmmsg(fd, msgv, n, 0) < 0)
+				return errno;
+
+			n = 0;
+			memset(msgv, 0, sizeof(msgv));
+		}
+	}
+
+	if (n && sendmmsg(fd, msgv, n, 0) < 0)
+		return errno;
+
+	return ferr;
+}
+#endif
+
+
+/**
+ * Multicast fan-out send handler
+ *
+ * Distributes one encoded frame to all senders sharing the source.
+ * The mbuf position is restored after writing each header into the
+ * STREAM_PRESZ area, so the payload is shared by all senders.
+ *
+ * @param ext_len RTP extension header Length
+ * @param marker  RTP marker
+ * @param rtp_ts  RTP timestamp
+ * @param mb      Data to send
+ * @param arg     Multicast fan-out object
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int mcfanout_send_handler(size_t ext_len, bool marker,
+	uint32_t rtp_ts, struct mbuf *mb, void *arg)
+{
+	struct mcfanout *fan = arg;
+	struct le *le;
+	int err = 0;
+
+	if (!mb)
+		return EINVAL;
+
+#ifdef __linux__
+	if (fan->batch && fan->us && !ext_len &&
+	    list_count(&fan->senderl) > 1) {
+		if (uag_call_count())
+			return 0;
+
+		return mcfanout_send_batch(fan, marker, rtp_ts, mb);
+	}
+#endif
+
+	LIST_FOREACH(&fan->senderl, le) {
+		struct mcsender *mcsender = le->data;
+
+		err |= mcsender_send_handler(ext_len, marker, rtp_ts, mb,
+			mcsender);
+	}
 
 	return err;
 }
@@ -160,6 +422,7 @@ int mcsender_alloc(struct sa *addr, const struct aucodec *codec)
 {
 	int err = 0;
 	struct mcsender *mcsender = NULL;
+	struct mcfanout *fan = NULL;
 	uint8_t ttl = multicast_ttl();
 
 	if (!addr || !codec)
@@ -176,6 +439,8 @@ int mcsender_alloc(struct sa *addr, const struct aucodec *codec)
 	sa_cpy(&mcsender->addr, addr);
 	mcsender->ac = codec;
 	mcsender->enable = true;
+	mcsender->ssrc = rand_u32();
+	mcsender->seq = rand_u16();
 
 	err = rtp_open(&mcsender->rtp, sa_af(&mcsender->addr));
 	if (err)
@@ -189,8 +454,47 @@ int mcsender_alloc(struct sa *addr, const struct aucodec *codec)
 			IP_MULTICAST_TTL, &ttl, sizeof(ttl));
 	}
 
-	err = mcsource_start(&mcsender->src, mcsender->ac,
-		mcsender_send_handler, mcsender);
+	fan = mcfanout_find(mcsender->ac);
+	if (!fan) {
+		fan = mem_zalloc(sizeof(*fan), mcfanout_destructor);
+		if (!fan) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		fan->ac = mcsender->ac;
+		(void)conf_get_bool(conf_cur(), "multicast_tx_batch",
+				    &fan->batch);
+		if (fan->batch) {
+			struct sa laddr;
+
+			fan->af = sa_af(&mcsender->addr);
+			sa_init(&laddr, fan->af);
+			err = udp_listen(&fan->us, &laddr, NULL, NULL);
+			if (err) {
+				warning ("multicast sender: batch socket "
+					"failed (%m)\n", err);
+				mem_deref(fan);
+				goto out;
+			}
+
+			if (ttl > 1)
+				udp_setsockopt(fan->us, IPPROTO_IP,
+					IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+		}
+
+		err = mcsource_start(&fan->src, fan->ac,
+			mcfanout_send_handler, fan);
+		if (err) {
+			mem_deref(fan);
+			goto out;
+		}
+
+		list_append(&mcfanoutl, &fan->le, fan);
+	}
+
+	mcsender->fan = fan;
+	list_append(&fan->senderl, &mcsender->fanle, mcsender);
 
 	list_append(&mcsenderl, &mcsender->le, mcsender);
 
@@ -57,6 +57,13 @@ struct mcsource {
 		thrd_t tid;
 		RE_ATOMIC bool run;
 	} thr;
+
+	struct {
+		uint8_t *buf;
+		size_t size;
+		RE_ATOMIC size_t head;
+		RE_ATOMIC size_t tail;
+	} ring;
 };
 
 
@@ -85,6 +92,86 @@ static void mcsource_destructor(void *arg)
 
 	src->module   = mem_deref(src->module);
 	src->device   = mem_deref(src->device);
+	src->ring.buf = mem_deref(src->ring.buf);
+}
+
+
+/**
+ * Number of bytes buffered in the capture ring
+ *
+ * @param src Multicast source object
+ *
+ * @return size_t number of readable bytes
+ */
+static size_t ring_used(const struct mcsource *src)
+{
+	return re_atomic_acq(&src->ring.head) -
+		re_atomic_acq(&src->ring.tail);
+}
+
+
+/**
+ * Write samples into the capture ring
+ *
+ * Single producer side, called from the real-time ausrc callback. The
+ * frame is dropped if the ring is full, the callback never blocks.
+ *
+ * @param src Multicast source object
+ * @param p   Sample data
+ * @param n   Number of bytes
+ *
+ * @return true if the data was written, false if the ring is full
+ */
+static bool ring_write(struct mcsource *src, const uint8_t *p, size_t n)
+{
+	size_t head = re_atomic_rlx(&src->ring.head);
+	size_t idx = head & (src->ring.size - 1);
+	size_t chunk;
+
+	if (src->ring.size - ring_used(src) < n)
+		return false;
+
+	chunk = src->ring.size - idx;
+	if (chunk > n)
+		chunk = n;
+
+	memcpy(&src->ring.buf[idx], p, chunk);
+	memcpy(src->ring.buf, p + chunk, n - chunk);
+
+	re_atomic_rls_set(&src->ring.head, head + n);
+	return true;
+}
+
+
+/**
+ * Read samples from the capture ring
+ *
+ * Single consumer side, called from the source thread
+ *
+ * @param src Multicast source object
+ * @param p   Destination buffer
+ * @param n   Number of bytes
+ *
+ * @return true if the data was read, false if not enough is buffered
+ */
+static bool ring_read(struct mcsource *src, uint8_t *p, size_t n)
+{
+	size_t tail = re_atomic_rlx(&src->ring.tail);
+	size_t idx = tail & (src->ring.size - 1);
+	size_t chunk;
+
+	if (ring_used(src) < n)
+		return false;
+
+	chunk = src->ring.size - idx;
+	if (chunk > n)
+		chunk = n;
+
+	memcpy(p, &src->ring.buf[idx], chunk);
+	memcpy(p + chunk, src->ring.buf, n - chunk);
+
+	re_atomic_rls_set(&src->ring.tail, tail + n);
+	return true;
 }
 
 
@@ -182,7 +269,10 @@ static void poll_aubuf_tx(struct mcsource *src)
 	sampc = num_bytes / sz;
 
 	if (src->src_fmt == AUFMT_S16LE) {
-		aubuf_read(src->aubuf, (uint8_t *)sampv, num_bytes);
+		if (src->ring.buf)
+			ring_read(src, (uint8_t *)sampv, num_bytes);
+		else
+			aubuf_read(src->aubuf, (uint8_t *)sampv, num_bytes);
 	}
 	else if (src->enc_fmt == AUFMT_S16LE) {
 		void *tmp_sampv = NULL;
@@ -191,7 +281,10 @@ static void poll_aubuf_tx(struct mcsource *src)
 		if (!tmp_sampv)
 			return;
 
-		aubuf_read(src->aubuf, tmp_sampv, num_bytes);
+		if (src->ring.buf)
+			ring_read(src, tmp_sampv, num_bytes);
+		else
+			aubuf_read(src->aubuf, tmp_sampv, num_bytes);
 		auconv_to_s16(sampv, src->src_fmt, tmp_sampv, sampc);
 		mem_deref(tmp_sampv);
 	}
@@ -282,7 +375,10 @@ static void ausrc_read_handler(struct auframe *af, void *arg)
 		return;
 	}
 
-	(void) aubuf_write(src->aubuf, af->sampv, num_bytes);
+	if (src->ring.buf)
+		(void) ring_write(src, af->sampv, num_bytes);
+	else
+		(void) aubuf_write(src->aubuf, af->sampv, num_bytes);
 	src->aubuf_started = true;
 
 	if (src->cfg->txmode == AUDIO_MODE_POLL) {
@@ -327,7 +423,11 @@ static int tx_thread(void *arg)
 		if (ts > now)
 			continue;
 
-		if (aubuf_cur_size(src->aubuf) >= src->psize)
+		if (src->ring.buf) {
+			if (ring_used(src) >= src->psize)
+				poll_aubuf_tx(src);
+		}
+		else if (aubuf_cur_size(src->aubuf) >= src->psize)
 			poll_aubuf_tx(src);
 
 		ts += src->ptime;
@@ -413,6 +513,19 @@ static int start_source(struct mcsource *src)
 			case AUDIO_MODE_POLL:
 				break;
 			case AUDIO_MODE_THREAD:
+				if (!src->ring.buf) {
+					size_t rsz = 1;
+
+					while (rsz < src->aubuf_maxsz)
+						rsz <<= 1;
+
+					src->ring.buf = mem_zalloc(rsz, NULL);
+					if (!src->ring.buf)
+						return ENOMEM;
+
+					src->ring.size = rsz;
+				}
+
 				if (!re_atomic_rlx(&src->thr.run)) {
 					re_atomic_rlx_set(&src->thr.run, true);
 					err = thread_create_name(&src->thr.tid,
@@ -3,6 +3,7 @@
  *
  * Copyright (C) 2023 Commend.com - c.spielberger@commend.com
  */
+#include <stdio.h>
 #include <string.h>
 #include <re.h>
 #include <rem.h>
@@ -26,37 +27,67 @@
  /mkpar <name>                   create a parallel call group with given name
  /rmpar <name>                   remove a parallel call group
  /paradd <name> <SIP address>    add a call target to a parallel group
+ /parimport <name> <file>        add call targets from file, one per line
  /parcall <name>                 initiate a parallel call of given group
  /pardebug                       print parallel call data
  \endverbatim
  */
 
+enum {
+	TEARDOWN_BATCH    = 8,   /* Losing calls hung up per timer tick  */
+	TEARDOWN_INTERVAL = 10,  /* Timer period in [ms]                 */
+};
+
+/* Setup latency histogram bucket limits in [ms]  */
+static const uint32_t lat_limv[] = {50, 100, 200, 500, 1000, 2000, 5000};
+
 /** Parallel call module data  */
 static struct {
 	struct hash *pargroups;
 	struct hash *parcalls;
+	struct list teardownl;   /**< Losing calls pending teardown       */
+	struct tmr teardown_tmr;
+
+	struct list dialq;       /**< Groups with pending dial-outs       */
+	struct tmr dial_tmr;
+	uint32_t rate;           /**< Dial rate in calls/s (0=burst)      */
+	uint32_t max_inflight;   /**< In-flight cap per group (0=off)     */
+
+	uint32_t latv[RE_ARRAY_SIZE(lat_limv) + 1];
+	size_t latc;             /**< Number of latency samples           */
 } d;
 
 struct pargroup {
 	struct le hle;
+	struct le dle;           /**< Member of dial queue                */
 
 	char *name;
 	struct list peers;       /**< List of parallel call peers          */
+	struct hash *peerh;      /**< Peers indexed by address            */
+
+	struct le *dialcur;      /**< Next peer to dial                   */
+	enum sdp_dir adir;       /**< Audio direction of pending dial-out */
+	enum sdp_dir vdir;       /**< Video direction of pending dial-out */
+	uint32_t inflight;       /**< Calls dialed but not yet concluded  */
 };
 
 struct parpeer {
 	struct le le;
+	struct le hle;           /**< Member of the group peer index      */
 
 	struct ua *ua;
 	char *addr;
-	const struct pargroup *group;
+	struct pargroup *group;
 };
 
 struct parcall {
 	struct le hle;
+	struct le tle;           /**< Member of teardown list             */
 
 	struct call *call;
-	const struct pargroup *group;
+	struct pargroup *group;
+	uint64_t ts_dial;        /**< Dial timestamp in [ms] (0=unknown)  */
+	bool concluded;          /**< Established or closed               */
 };
 
 struct callarg {
@@ -66,13 +97,32 @@ struct callarg {
 };
 
 
+/* Drop the tracking entry of a call that belongs to a dying group  */
+static bool parcall_flush(struct le *le, void *arg)
+{
+	struct parcall *c = le->data;
+
+	if (c->group != arg)
+		return false;
+
+	mem_deref(c);
+	return false;
+}
+
+
 static void pargroup_destructor(void *arg)
 {
 	struct pargroup *g = arg;
 
+	/* calls of this group may still be in flight, their entries must
+	 * not outlive the group they point at */
+	(void)hash_apply(d.parcalls, parcall_flush, g);
+
 	mem_deref(g->name);
 	list_flush(&g->peers);
+	mem_deref(g->peerh);
 	hash_unlink(&g->hle);
+	list_unlink(&g->dle);
 }
 
 
@@ -81,6 +131,7 @@ static void parpeer_destructor(void *arg)
 	struct parpeer *p = arg;
 
 	list_unlink(&p->le);
+	hash_unlink(&p->hle);
 	mem_deref(p->addr);
 }
 
@@ -90,6 +141,7 @@ static void parcall_destructor(void *arg)
 	struct parcall *c = arg;
 
 	hash_unlink(&c->hle);
+	list_unlink(&c->tle);
 }
 
 
@@ -137,23 +189,155 @@ static bool parcall_first(struct le *le, void *arg)
 }
 
 
-static bool parcall_hangup(struct le *le, void *arg)
+static bool parcall_mark(struct le *le, void *arg)
 {
 	struct parcall *c  = le->data;
 	struct parcall *c0 = arg;
-	struct call *call;
 
-	if (c->group != c0->group)
+	if (c->group != c0->group || c->call == c0->call)
 		return false;
 
-	call = c->call;
-	if (call != c0->call)
-		(void)ua_hangup(call_get_ua(call), call, 0, NULL);
+	if (!list_contains(&d.teardownl, &c->tle))
+		list_append(&d.teardownl, &c->tle, c);
 
 	return false;
 }
 
 
+/**
+ * Hang up a batch of losing calls
+ *
+ * The losers are marked in the event handler and destroyed a few per
+ * timer tick, so a large group never stalls the main thread while the
+ * winning call sets up its media.
+ *
+ * @param arg  not used
+ */
+static void teardown_handler(void *arg)
+{
+	unsigned i;
+	(void)arg;
+
+	for (i = 0; i < TEARDOWN_BATCH; i++) {
+		struct le *le = list_head(&d.teardownl);
+		struct parcall *c;
+
+		if (!le)
+			return;
+
+		c = le->data;
+		list_unlink(&c->tle);
+		(void)ua_hangup(call_get_ua(c->call), c->call, 0, NULL);
+	}
+
+	if (!list_isempty(&d.teardownl))
+		tmr_start(&d.teardown_tmr, TEARDOWN_INTERVAL,
+			  teardown_handler, NULL);
+}
+
+
+static void lat_record(uint64_t ms)
+{
+	size_t i;
+
+	for (i = 0; i < RE_ARRAY_SIZE(lat_limv); i++) {
+		if (ms <= lat_limv[i])
+			break;
+	}
+
+	++d.latv[i];
+	++d.latc;
+}
+
+
+/* Upper bucket limit covering the given percentile, 0 for ">5000"  */
+static uint32_t lat_percentile(unsigned p)
+{
+	size_t cum = 0;
+	size_t i;
+
+	for (i = 0; i < RE_ARRAY_SIZE(lat_limv); i++) {
+		cum += d.latv[i];
+		if (100 * cum >= (uint64_t)p * d.latc)
+			return lat_limv[i];
+	}
+
+	return 0;
+}
+
+
+static void conclude(struct parcall *c)
+{
+	if (c->concluded)
+		return;
+
+	c->concluded = true;
+	if (c->group->inflight)
+		--c->group->inflight;
+}
+
+
+static int dial_one(struct pargroup *g)
+{
+	struct parpeer *peer = g->dialcur->data;
+	struct call *call;
+	struct parcall *c;
+	int err;
+
+	g->dialcur = g->dialcur->next;
+
+	err = ua_connect_dir(peer->ua, &call, NULL, peer->addr, VIDMODE_ON,
+			     g->adir, g->vdir);
+	if (err) {
+		warning("parcall: could not dial %s (%m)\n", peer->addr, err);
+		return err;
+	}
+
+	info("parcall: dialed %s call id: %s\n", peer->addr, call_id(call));
+
+	c = mem_zalloc(sizeof(*c), parcall_destructor);
+	if (!c)
+		return ENOMEM;
+
+	c->call    = call;
+	c->group   = g;
+	c->ts_dial = tmr_jiffies();
+	++g->inflight;
+	hash_append(d.parcalls, hash_fast_str(call_id(call)), &c->hle, c);
+	return 0;
+}
+
+
+/**
+ * Dial out pending parallel calls at the configured pace
+ *
+ * One call per queued group is dialed per tick, groups at their
+ * in-flight cap are skipped until a call of theirs concludes.
+ *
+ * @param arg  not used
+ */
+static void dial_handler(void *arg)
+{
+	struct le *le = list_head(&d.dialq);
+	(void)arg;
+
+	while (le) {
+		struct pargroup *g = le->data;
+
+		le = le->next;
+		if (d.max_inflight && g->inflight >= d.max_inflight)
+			continue;
+
+		(void)dial_one(g);
+		if (!g->dialcur)
+			list_unlink(&g->dle);
+	}
+
+	if (!list_isempty(&d.dialq))
+		tmr_start(&d.dial_tmr, 1000 / d.rate, dial_handler, NULL);
+}
+
+
 static bool parcall_debug(struct le *le, void *arg)
 {
 	struct parcall *c = le->data;
@@ -179,12 +363,32 @@ static void event_handler(enum ua_event ev, struct bevent *event, void *arg)
 	switch (ev) {
 	case UA_EVENT_CALL_ESTABLISHED:
 	{
+		struct parcall *c;
+
 		le = hash_lookup(d.parcalls, hash_fast_str(call_id(call)),
 				 parcall_first, NULL);
 		if (!le)
 			break;
 
-		hash_apply(d.parcalls, parcall_hangup, le->data);
+		c = le->data;
+
+		/* A call already marked for teardown lost the race, its
+		 * group has a winner. Hang it up right away instead of
+		 * re-marking the group, which would tear the winner down.
+		 */
+		if (list_contains(&d.teardownl, &c->tle)) {
+			list_unlink(&c->tle);
+			(void)ua_hangup(call_get_ua(c->call), c->call,
+					0, NULL);
+			break;
+		}
+
+		if (c->ts_dial)
+			lat_record(tmr_jiffies() - c->ts_dial);
+
+		conclude(c);
+		hash_apply(d.parcalls, parcall_mark, c);
+		tmr_start(&d.teardown_tmr, 0, teardown_handler, NULL);
 	}
 
 	break;
@@ -195,6 +399,7 @@ static void event_handler(enum ua_event ev, struct bevent *event, void *arg)
 		if (!le)
 			break;
 
+		conclude(le->data);
 		mem_deref(le->data);
 	}
 	break;
@@ -239,7 +444,8 @@ static int cmd_mkpar(struct re_printf *pf, void *arg)
 	if (!g)
 		return ENOMEM;
 
-	err = str_dup(&g->name, carg->prm);
+	err  = str_dup(&g->name, carg->prm);
+	err |= hash_alloc(&g->peerh, 32);
 	if (err) {
 		mem_deref(g);
 		return err;
@@ -296,8 +502,10 @@ static bool parpeer_call(struct le *le, void *arg)
 	if (!c)
 		return true;
 
-	c->call  = call;
-	c->group = peer->group;
+	c->call    = call;
+	c->group   = peer->group;
+	c->ts_dial = tmr_jiffies();
+	++peer->group->inflight;
 	hash_append(d.parcalls, hash_fast_str(call_id(call)), &c->hle, c);
 	return false;
 }
@@ -352,6 +560,66 @@ static int cmd_clrpar(struct re_printf *pf, void *arg)
 }
 
 
+/*
+ * Add a call target to a group
+ *
+ * Duplicates are detected via the per-group peer index, so bulk
+ * imports stay linear in the number of targets.
+ */
+static int peer_add(struct re_printf *pf, struct pargroup *g,
+		    const struct pl *dname, const struct pl *addr)
+{
+	char *addrstr;
+	struct parpeer *peer;
+	struct ua *ua;
+	int err;
+
+	ua = uag_find_requri_pl(addr);
+	if (!ua) {
+		(void)re_hprintf(pf, "paradd: could not find UA for %r\n",
+				 addr);
+		return EINVAL;
+	}
+
+	if (pl_isset(dname)) {
+		err = re_sdprintf(&addrstr, "\"%r\" <%r>", dname, addr);
+	}
+	else {
+		err = account_uri_complete_strdup(ua_account(ua), &addrstr,
+						  addr);
+	}
+
+	if (err)
+		goto out;
+
+	if (hash_lookup(g->peerh, hash_fast_str(addrstr), parpeer_find,
+			addrstr)) {
+		(void)re_hprintf(pf, "paradd: %s already a target of %s\n",
+				 addrstr, g->name);
+		err = EINVAL;
+		goto out;
+	}
+
+	peer = mem_zalloc(sizeof(*peer), parpeer_destructor);
+	if (!peer) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	peer->ua    = ua;
+	peer->group = g;
+	peer->addr  = addrstr;
+	list_append(&g->peers, &peer->le, peer);
+	hash_append(g->peerh, hash_fast_str(addrstr), &peer->hle, peer);
+
+out:
+	if (err)
+		mem_deref(addrstr);
+
+	return err;
+}
+
+
 /**
  * Add a parallel call target to a group
  *
@@ -365,11 +633,8 @@ static int cmd_paradd(struct re_printf *pf, void *arg)
 {
 	struct cmd_arg *carg = arg;
 	struct pl name, addr;
-	char *addrstr;
 	struct pl dname = PL_INIT;
 	struct pargroup *g;
-	struct parpeer *peer;
-	struct ua *ua;
 	int err;
 	const char *usage = "usage: /paradd <name> <URI>\n"
 			    "       /paradd <name> <display name> <sip:uri>\n";
@@ -398,47 +663,85 @@ static int cmd_paradd(struct re_printf *pf, void *arg)
 	if (!g)
 		return EINVAL;
 
-	ua = uag_find_requri_pl(&addr);
-	if (!ua) {
-		(void)re_hprintf(pf, "paradd: could not find UA for %r\n",
-				 &addr);
-		return EINVAL;
-	}
+	return peer_add(pf, g, &dname, &addr);
+}
 
-	if (pl_isset(&dname)) {
-		err = re_sdprintf(&addrstr, "\"%r\" <%r>", &dname, &addr);
-	}
-	else {
-		err = account_uri_complete_strdup(ua_account(ua), &addrstr,
-						  &addr);
-	}
 
-	if (err)
-		goto out;
+/**
+ * Import parallel call targets of a group from file
+ *
+ * One target per line, either a plain URI or a display name followed
+ * by <sip:uri>. Empty lines and lines starting with '#' are skipped.
+ *
+ * @param pf   Print handler
+ * @param arg  Command arguments (carg)
+ *             carg->prm holds: <name> <file>
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+static int cmd_parimport(struct re_printf *pf, void *arg)
+{
+	struct cmd_arg *carg = arg;
+	struct pl name, file;
+	struct pargroup *g;
+	char path[256];
+	char line[512];
+	FILE *f;
+	uint32_t n = 0;
+	uint32_t added = 0;
+	int err;
+	const char *usage = "usage: /parimport <name> <file>\n";
 
-	if (list_apply(&g->peers, true, parpeer_find, addrstr)) {
-		(void)re_hprintf(pf, "paradd: %s already a target of %r\n",
-				 addrstr, &name);
-		err = EINVAL;
-		goto out;
+	err = re_regex(carg->prm, str_len(carg->prm), "[^ ]+ [^ ]+",
+		       &name, &file);
+	if (err) {
+		(void)re_hprintf(pf, "%s", usage);
+		return err;
 	}
 
-	peer = mem_zalloc(sizeof(*peer), parpeer_destructor);
-	if (!peer) {
-		err = ENOMEM;
-		goto out;
+	g = find_pargroup(pf, &name, "parimport");
+	if (!g)
+		return EINVAL;
+
+	(void)pl_strcpy(&file, path, sizeof(path));
+	f = fopen(path, "r");
+	if (!f) {
+		err = errno;
+		(void)re_hprintf(pf, "parimport: could not open %s (%m)\n",
+				 path, err);
+		return err;
 	}
 
-	peer->ua    = ua;
-	peer->group = g;
-	peer->addr  = addrstr;
-	list_append(&g->peers, &peer->le, peer);
+	while (fgets(line, sizeof(line), f)) {
+		struct pl dname = PL_INIT;
+		struct pl addr;
+		struct pl trim;
+
+		pl_set_str(&trim, line);
+		while (trim.l && (trim.p[trim.l - 1] == '\n' ||
+				  trim.p[trim.l - 1] == '\r'))
+			--trim.l;
+
+		if (!trim.l || trim.p[0] == '#')
+			continue;
+
+		++n;
+		err = re_regex(trim.p, trim.l, "[~<]*[ \t]*<[^>]+>",
+			       &dname, NULL, &addr);
+		if (err) {
+			dname = pl_null;
+			addr  = trim;
+		}
+
+		if (0 == peer_add(pf, g, &dname, &addr))
+			++added;
+	}
 
-out:
-	if (err)
-		mem_deref(addrstr);
+	(void)fclose(f);
+	(void)re_hprintf(pf, "parimport: added %u of %u targets to %r\n",
+			 added, n, &name);
 
-	return err;
+	return 0;
 }
 
 
@@ -503,6 +806,20 @@ static int cmd_parcall(struct re_printf *pf, void *arg)
 		return EINVAL;
 	}
 
+	if (d.rate) {
+		g->adir    = callarg.adir;
+		g->vdir    = callarg.vdir;
+		g->dialcur = list_head(&g->peers);
+		if (!list_contains(&d.dialq, &g->dle))
+			list_append(&d.dialq, &g->dle, g);
+
+		tmr_start(&d.dial_tmr, 0, dial_handler, NULL);
+		(void)re_hprintf(pf, "parcall: dialing %u targets of %r at "
+				 "%u calls/s\n", list_count(&g->peers), &name,
+				 d.rate);
+		return 0;
+	}
+
 	(void)list_apply(&g->peers, true, parpeer_call, &callarg);
 	return 0;
 }
@@ -527,6 +844,15 @@ static int cmd_pardebug(struct re_printf *pf, void *arg)
 	(void)re_hprintf(pf, "Active calls\n");
 	(void)hash_apply(d.parcalls,  parcall_debug, pf);
 	(void)re_hprintf(pf, "\n");
+
+	if (d.latc) {
+		(void)re_hprintf(pf, "Setup latency (n=%zu)\n", d.latc);
+		(void)re_hprintf(pf, "  p50 <= %u ms\n", lat_percentile(50));
+		(void)re_hprintf(pf, "  p90 <= %u ms\n", lat_percentile(90));
+		(void)re_hprintf(pf, "  p99 <= %u ms\n", lat_percentile(99));
+		(void)re_hprintf(pf, "\n");
+	}
+
 	return 0;
 }
 
@@ -536,6 +862,7 @@ static const struct cmd cmdv[] = {
 	{"rmpar",    0,CMD_PRM, "Remove parallel call group",    cmd_rmpar   },
 	{"clrpar",   0,      0, "Clear parallel call groups",    cmd_clrpar  },
 	{"paradd",   0,CMD_PRM, "Add a call target to a group",  cmd_paradd  },
+	{"parimport",0,CMD_PRM, "Import call targets from file", cmd_parimport},
 	{"parcall",  0,CMD_PRM, "Initiate parallel call to given group",
 								 cmd_parcall },
 	{"pardebug", 0,      0, "Print parallel call data",	 cmd_pardebug},
@@ -552,6 +879,10 @@ static int module_init(void)
 	if (err)
 		return err;
 
+	(void)conf_get_u32(conf_cur(), "parcall_dial_rate", &d.rate);
+	(void)conf_get_u32(conf_cur(), "parcall_max_inflight",
+			   &d.max_inflight);
+
 	err  = bevent_register(event_handler, NULL);
 	err |= cmd_register(baresip_commands(), cmdv, RE_ARRAY_SIZE(cmdv));
 	if (err)
@@ -564,6 +895,8 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	tmr_cancel(&d.teardown_tmr);
+	tmr_cancel(&d.dial_tmr);
 	bevent_unregister(event_handler);
 	cmd_unregister(baresip_commands(), cmdv);
 	hash_flush(d.pargroups);
@@ -35,27 +35,72 @@
  */
 
 
+enum {
+	TICK_MS = 250,          /* Timer wheel tick in [ms] */
+};
+
+
+/** Shared reachability state, one per remote target  */
+struct qualpeer {
+	struct le he;
+	char uri[128];          /**< OPTIONS request URI                  */
+	struct list subl;       /**< Subscribed qualify entries           */
+	bool offline;
+	uint32_t qual_int;      /**< Qualify interval in [s]              */
+	uint32_t qual_to;       /**< Qualify timeout in [s]               */
+	uint64_t next_ping;     /**< Next OPTIONS deadline (0=stopped)    */
+	uint64_t to_deadline;   /**< Response deadline (0=no ping active) */
+};
+
+
 struct qualle {
 	struct le he;
+	struct le ple;          /**< Member of the peer subscriber list   */
 	struct call *call;
-	bool offline;
-	struct tmr int_tmr;
-	struct tmr to_tmr;
+	struct qualpeer *peer;  /**< Shared peer state (ref)              */
 };
 
 
 struct qualify {
 	struct hash *qual_map;
+	struct hash *peer_map;  /**< Peers keyed by request URI           */
+	struct tmr tick_tmr;    /**< Shared timer wheel for all peers     */
+	uint32_t npeer;         /**< Number of qualified peers            */
 };
 
 
-static struct qualify q = { NULL };
+static struct qualify q;
 
 
 /* Forward declaration */
-static void call_start_qualify(struct call *call,
-			       const struct account *acc,
-			       struct qualle *qualle);
+static void tick_handler(void *arg);
+static void qualpeer_send(struct qualpeer *peer);
+
+
+static void qualpeer_destructor(void *arg)
+{
+	struct qualpeer *peer = arg;
+
+	hash_unlink(&peer->he);
+	--q.npeer;
+}
+
+
+static void qualle_unsubscribe(struct qualle *qualle)
+{
+	struct qualpeer *peer = qualle->peer;
+
+	if (!peer)
+		return;
+
+	list_unlink(&qualle->ple);
+	if (list_isempty(&peer->subl)) {
+		peer->next_ping   = 0;
+		peer->to_deadline = 0;
+	}
+
+	qualle->peer = mem_deref(peer);
+}
 
 
 static void qualle_destructor(void *arg)
@@ -63,8 +108,7 @@ static void qualle_destructor(void *arg)
 	struct qualle *qualle = arg;
 
 	hash_unlink(&qualle->he);
-	tmr_cancel(&qualle->to_tmr);
-	tmr_cancel(&qualle->int_tmr);
+	qualle_unsubscribe(qualle);
 }
 
 
@@ -101,63 +145,156 @@ static int account_extra_uint(const struct account *acc, const char *n,
 }
 
 
+/*
+ * Fan out a reachability transition to all subscribed calls
+ */
+static void qualpeer_fanout(struct qualpeer *peer, const char *txt)
+{
+	struct le *le;
+
+	LIST_FOREACH(&peer->subl, le) {
+		struct qualle *qualle = le->data;
+
+		if (!qualle->call)
+			continue;
+
+		module_event("qualify", txt, call_get_ua(qualle->call),
+			     qualle->call, "");
+	}
+}
+
+
 static void options_resp_handler(int err, const struct sip_msg *msg, void *arg)
 {
 	(void)msg;
-	struct qualle *qualle = arg;
+	struct qualpeer *peer = arg;
 
 	if (err) {
 		info("qualify: OPTIONS reply error (%m)\n", err);
-		mem_deref(qualle);
+		mem_deref(peer);
 		return;
 	}
 
-	tmr_cancel(&qualle->to_tmr);
+	peer->to_deadline = 0;
 
-	if (qualle->offline && qualle->call) {
-		qualle->offline = false;
-		module_event("qualify", "peer online",
-			     call_get_ua(qualle->call), qualle->call, "");
+	if (peer->offline) {
+		peer->offline = false;
+		qualpeer_fanout(peer, "peer online");
 	}
 
-	mem_deref(qualle);
+	mem_deref(peer);
 }
 
 
-static void to_handler(void *arg)
+static void qualpeer_timeout(struct qualpeer *peer)
 {
-	struct qualle *qualle = arg;
-	struct call *call = qualle->call;
-	uint32_t qual_to = 0;
-	account_extra_uint(call_account(call), "qual_to", &qual_to);
-
-	if (!qualle->offline) {
-		qualle->offline = true;
-		module_event("qualify", "peer offline",
-			     call_get_ua(qualle->call), qualle->call, "");
+	if (!peer->offline) {
+		peer->offline = true;
+		qualpeer_fanout(peer, "peer offline");
 	}
 
 	debug("qualify: no response received to OPTIONS in %u seconds",
-	      qual_to);
+	      peer->qual_to);
 }
 
 
-static void interval_handler(void *arg)
+static bool tick_applyh(struct le *le, void *arg)
 {
-	struct qualle *qualle = arg;
-	call_start_qualify(qualle->call, call_account(qualle->call), qualle);
+	struct qualpeer *peer = le->data;
+	const uint64_t *now = arg;
+
+	if (peer->to_deadline && *now >= peer->to_deadline) {
+		peer->to_deadline = 0;
+		qualpeer_timeout(peer);
+	}
+
+	if (peer->next_ping && *now >= peer->next_ping) {
+		peer->next_ping = *now + peer->qual_int * 1000;
+		qualpeer_send(peer);
+	}
+
+	return false;
 }
 
 
-static void call_start_qualify(struct call *call,
-			      const struct account *acc,
-			      struct qualle *qualle)
+/*
+ * Single coarse timer driving all qualified peers
+ *
+ * One pass over the peer map per tick batches all due OPTIONS
+ * requests and expires pending response deadlines, instead of two
+ * armed timers per entry.
+ */
+static void tick_handler(void *arg)
+{
+	uint64_t now = tmr_jiffies();
+	(void)arg;
+
+	hash_apply(q.peer_map, tick_applyh, &now);
+
+	if (q.npeer)
+		tmr_start(&q.tick_tmr, TICK_MS, tick_handler, NULL);
+}
+
+
+static void qualpeer_send(struct qualpeer *peer)
+{
+	struct ua *ua = NULL;
+	struct le *le;
+	int err;
+
+	/* The UA is taken from a live subscriber at send time. A cached
+	 * pointer could dangle once the UA that set it is destroyed while
+	 * calls of other UAs keep the shared peer alive. */
+	LIST_FOREACH(&peer->subl, le) {
+		struct qualle *qualle = le->data;
+
+		if (qualle->call) {
+			ua = call_get_ua(qualle->call);
+			break;
+		}
+	}
+
+	if (!ua)
+		return;
+
+	err = ua_options_send(ua, peer->uri,
+			      options_resp_handler, mem_ref(peer));
+	if (err) {
+		mem_deref(peer);
+		warning("qualify: sending OPTIONS failed (%m)\n", err);
+		return;
+	}
+
+	if (!peer->to_deadline)
+		peer->to_deadline = tmr_jiffies() + peer->qual_to * 1000;
+}
+
+
+static bool qualpeer_get_applyh(struct le *le, void *arg)
+{
+	const struct qualpeer *peer = le->data;
+
+	return 0 == str_cmp(peer->uri, arg);
+}
+
+
+/*
+ * Start qualifying the peer of an incoming call
+ *
+ * All calls from the same remote target share one qualpeer, so only a
+ * single OPTIONS probe per target and interval is sent regardless of
+ * how many calls are ringing from it.
+ */
+static void call_start_qualify(struct call *call, const struct account *acc)
 {
 	struct sa peer_addr;
 	char peer_uri[128];
 	uint32_t qual_to = 0;
 	uint32_t qual_int = 0;
-	int newle = qualle == NULL;
+	struct qualpeer *peer;
+	struct qualle *qualle;
+	struct le *le;
+	bool first;
 
 	account_extra_uint(acc, "qual_int", &qual_int);
 	account_extra_uint(acc, "qual_to", &qual_to);
@@ -171,18 +308,6 @@ static void call_start_qualify(struct call *call,
 		return;
 	}
 
-	if (newle) {
-		qualle = mem_zalloc(sizeof(*qualle), qualle_destructor);
-		if (!qualle)
-			return;
-
-		qualle->call = call;
-		tmr_init(&qualle->to_tmr);
-		tmr_init(&qualle->int_tmr);
-		hash_append(q.qual_map, hash_fast_str(call_id(call)),
-			    &qualle->he, qualle);
-	}
-
 	(void)call_msg_src(call, &peer_addr);
 
 	int n = re_snprintf(peer_uri, sizeof(peer_uri),
@@ -195,18 +320,49 @@ static void call_start_qualify(struct call *call,
 		return;
 	}
 
-	int err = ua_options_send(call_get_ua(call), peer_uri,
-				  options_resp_handler, mem_ref(qualle));
-	if (err) {
-		mem_deref(qualle);
-		warning("qualify: sending OPTIONS failed (%m)\n", err);
-		tmr_start(&qualle->int_tmr, qual_int * 1000, interval_handler,
-			  qualle);
+	qualle = mem_zalloc(sizeof(*qualle), qualle_destructor);
+	if (!qualle)
 		return;
+
+	qualle->call = call;
+	hash_append(q.qual_map, hash_fast_str(call_id(call)),
+		    &qualle->he, qualle);
+
+	le = hash_lookup(q.peer_map, hash_fast_str(peer_uri),
+			 qualpeer_get_applyh, peer_uri);
+	if (le) {
+		peer = mem_ref(le->data);
+		peer->qual_int = min(peer->qual_int, qual_int);
+		peer->qual_to  = min(peer->qual_to,  qual_to);
+	}
+	else {
+		peer = mem_zalloc(sizeof(*peer), qualpeer_destructor);
+		if (!peer) {
+			mem_deref(qualle);
+			return;
+		}
+
+		str_ncpy(peer->uri, peer_uri, sizeof(peer->uri));
+		peer->qual_int = qual_int;
+		peer->qual_to  = qual_to;
+		hash_append(q.peer_map, hash_fast_str(peer->uri),
+			    &peer->he, peer);
+		if (!q.npeer++)
+			tmr_start(&q.tick_tmr, TICK_MS, tick_handler, NULL);
 	}
 
-	tmr_start(&qualle->to_tmr, qual_to * 1000, to_handler, qualle);
-	tmr_start(&qualle->int_tmr, qual_int * 1000, interval_handler, qualle);
+	first = list_isempty(&peer->subl);
+	list_append(&peer->subl, &qualle->ple, qualle);
+	qualle->peer = peer;
+
+	if (first) {
+		peer->next_ping = tmr_jiffies() + peer->qual_int * 1000;
+		qualpeer_send(peer);
+	}
+	else if (peer->offline) {
+		module_event("qualify", "peer offline", call_get_ua(call),
+			     call, "");
+	}
 }
 
 
@@ -231,16 +387,6 @@ static struct qualle *call_get_qualle(struct call *call)
 }
 
 
-static void qualle_stop_tmrs(struct qualle *qualle)
-{
-	if (!qualle)
-		return;
-
-	tmr_cancel(&qualle->to_tmr);
-	tmr_cancel(&qualle->int_tmr);
-}
-
-
 static void event_handler(enum ua_event ev, struct bevent *event, void *arg)
 {
 	struct ua   *ua   = bevent_get_ua(event);
@@ -251,7 +397,7 @@ static void event_handler(enum ua_event ev, struct bevent *event, void *arg)
 
 	switch (ev) {
 		case UA_EVENT_CALL_INCOMING:
-			(void)call_start_qualify(call, acc, NULL);
+			call_start_qualify(call, acc);
 			break;
 
 		case UA_EVENT_CALL_ESTABLISHED:
@@ -259,12 +405,13 @@ static void event_handler(enum ua_event ev, struct bevent *event, void *arg)
 			    break;
 
 			qualle = call_get_qualle(call);
-			qualle_stop_tmrs(qualle);
+			if (qualle)
+				qualle_unsubscribe(qualle);
+
 			break;
 
 		case UA_EVENT_CALL_CLOSED:
 			qualle = call_get_qualle(call);
-			qualle_stop_tmrs(qualle);
 
 			if (qualle) {
 				qualle->call = NULL;
@@ -286,6 +433,7 @@ static int module_init(void)
 
 	err  = bevent_register(event_handler, NULL);
 	err |= hash_alloc(&q.qual_map, 32);
+	err |= hash_alloc(&q.peer_map, 32);
 
 	return err;
 }
@@ -294,8 +442,11 @@ static int module_init(void)
 static int module_close(void)
 {
 	bevent_unregister(event_handler);
+	tmr_cancel(&q.tick_tmr);
 	hash_flush(q.qual_map);
+	hash_flush(q.peer_map);
 	mem_deref(q.qual_map);
+	mem_deref(q.peer_map);
 
 	return 0;
 }
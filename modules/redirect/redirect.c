@@ -4,7 +4,9 @@
  * Copyright (C) 2024 Commend.com - c.spielberger@commend.com
  */
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <re.h>
 #include <rem.h>
 #include <baresip.h>
@@ -53,6 +55,13 @@
  *
  * uaredirect_debug
  *
+ * Persistence
+ * -----------
+ * UA redirects are stored in the file `redirect_store` in the config
+ * path whenever one is added, removed or expires, keyed by the
+ * account AOR with an absolute expiry timestamp. The store is
+ * reloaded at module init, so absence state survives a restart.
+ *
  * callredirect [callid] [scode=<scode>] [reason=<reason>]
  *			 [contact=<target contact>] [expires=<expires/s>]
  *			 [params=<diversion params>]
@@ -64,11 +73,22 @@
 /** Redirect list set by user  */
 static struct {
 	struct list redirs;
-} d = { LIST_INIT };
+	struct hash *redhash;    /**< Redirects indexed by UA             */
+} d = { LIST_INIT, NULL };
+
+static char store_path[256]; /**< Persistent store file ("" = disabled) */
+
+
+static struct tmr load_tmr;  /**< Deferred store reload at startup      */
+
+
+/* Forward declaration */
+static void store_save(void);
 
 /** Redirection  */
 struct redirect {
 	struct le le;
+	struct le hle;           /**< Hash entry keyed by UA              */
 
 	struct ua *ua;
 	uint16_t scode;
@@ -76,6 +96,7 @@ struct redirect {
 	struct tmr tmr;
 	char *contact;
 	char *divparams;
+	char *hdrs;              /**< Precompiled response headers        */
 };
 
 /** Redirection command parsing structure  */
@@ -93,10 +114,18 @@ static void redirect_destructor(void *arg)
 {
 	struct redirect *r = arg;
 
+	hash_unlink(&r->hle);
 	tmr_cancel(&r->tmr);
 	mem_deref(r->reason);
 	mem_deref(r->contact);
 	mem_deref(r->divparams);
+	mem_deref(r->hdrs);
+}
+
+
+static uint32_t redirect_hash(const struct ua *ua)
+{
+	return hash_fast((const char *)&ua, sizeof(ua));
 }
 
 
@@ -131,6 +160,7 @@ static void redirect_expired(void *arg)
 
 	list_unlink(&r->le);
 	mem_deref(r);
+	store_save();
 }
 
 
@@ -162,26 +192,23 @@ static void event_handler(enum ua_event ev, struct bevent *event, void *arg)
 	switch (ev) {
 	case UA_EVENT_SIPSESS_CONN:
 	{
-		le = list_apply(&d.redirs, true, redirect_search, ua);
+		le = hash_lookup(d.redhash, redirect_hash(ua),
+				 redirect_search, ua);
 		if (!le)
 			break;
 
 		struct redirect *r = le->data;
 		char *expstr = NULL;
-		int err = expires_alloc(&expstr,
-			  (uint32_t) tmr_get_expire(&r->tmr));
-		if (err)
-			return;
+
+		if (tmr_isrunning(&r->tmr))
+			(void)expires_alloc(&expstr, (uint32_t)
+				((tmr_get_expire(&r->tmr) + 999) / 1000));
 
 		(void)sip_treplyf(NULL, NULL, uag_sip(), msg, false,
 				  r->scode, r->reason,
-				  "Contact: <%s>%s\r\n"
-				  "Diversion: <%s>%s\r\n"
-				  "Content-Length: 0\r\n\r\n",
-				  r->contact,
-				  expstr,
-				  account_aor(ua_account(ua)),
-				  r->divparams);
+				  "Contact: <%s>%s\r\n%s",
+				  r->contact, expstr ? expstr : "",
+				  r->hdrs);
 		mem_deref(expstr);
 		bevent_stop(event);
 	}
@@ -215,7 +242,7 @@ static void ua_redir_clear(struct ua *ua)
 {
 	struct le *le;
 
-	le = list_apply(&d.redirs, true, redirect_search, ua);
+	le = hash_lookup(d.redhash, redirect_hash(ua), redirect_search, ua);
 	if (!le)
 		return;
 
@@ -242,6 +269,159 @@ static void redirect_parse(struct redir_params *params,
 }
 
 
+static int redirect_add(struct ua *ua, const struct redir_params *params)
+{
+	struct redirect *r;
+	int err;
+
+	ua_redir_clear(ua);
+	r = mem_zalloc(sizeof(*r), redirect_destructor);
+	if (!r)
+		return ENOMEM;
+
+	r->ua = ua;
+	tmr_init(&r->tmr);
+	r->scode = pl_isset(&params->scode) ? pl_u32(&params->scode) : 302;
+
+	if (pl_isset(&params->reason))
+		err = pl_strdup(&r->reason, &params->reason);
+	else
+		err = str_dup(&r->reason, "Moved Temporarily");
+
+	if (pl_isset(&params->contact))
+		err |= pl_strdup(&r->contact, &params->contact);
+
+	if (params->expires)
+		tmr_start(&r->tmr, params->expires*1000, redirect_expired, r);
+
+	if (pl_isset(&params->divparams))
+		err |= pl_strdup(&r->divparams, &params->divparams);
+
+	/* precompile the response headers once, so rejecting a call is
+	 * just a lookup and a canned send. The Contact expires parameter
+	 * is rendered at reply time from the remaining timer lifetime */
+	err |= re_sdprintf(&r->hdrs,
+			   "Diversion: <%s>%s\r\n"
+			   "Content-Length: 0\r\n\r\n",
+			   account_aor(ua_account(ua)),
+			   r->divparams);
+	if (err) {
+		mem_deref(r);
+		return err;
+	}
+
+	list_append(&d.redirs, &r->le, r);
+	hash_append(d.redhash, redirect_hash(ua), &r->hle, r);
+	return 0;
+}
+
+
+/*
+ * Write all UA redirects to the persistent store
+ *
+ * The store is small, so it is rewritten as a whole on every change
+ * instead of appending a journal. Expiry is stored as absolute wall
+ * clock time so reload can restore the remaining lifetime.
+ */
+static void store_save(void)
+{
+	struct le *le;
+	FILE *f;
+
+	if (!str_isset(store_path))
+		return;
+
+	f = fopen(store_path, "w");
+	if (!f) {
+		warning("redirect: could not write %s\n", store_path);
+		return;
+	}
+
+	LIST_FOREACH(&d.redirs, le) {
+		struct redirect *r = le->data;
+		uint64_t expat = 0;
+
+		if (tmr_isrunning(&r->tmr))
+			expat = (uint64_t)time(NULL) +
+				(tmr_get_expire(&r->tmr) + 999) / 1000;
+
+		(void)re_fprintf(f, "aor=%s,scode=%u,expires_at=%llu,"
+				 "contact=%s,params=%s,reason=%s\n",
+				 account_aor(ua_account(r->ua)),
+				 r->scode, expat,
+				 r->contact ? r->contact : "",
+				 r->divparams ? r->divparams : "",
+				 r->reason);
+	}
+
+	(void)fclose(f);
+}
+
+
+static void store_load(void)
+{
+	char line[512];
+	FILE *f;
+	uint32_t n = 0;
+
+	if (!str_isset(store_path))
+		return;
+
+	f = fopen(store_path, "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		struct redir_params params = { 0 };
+		struct pl pl, aor, v;
+		struct ua *ua;
+		uint64_t expat = 0;
+		char *aorstr = NULL;
+
+		pl_set_str(&pl, line);
+		if (!fmt_param_sep_get(&pl, "aor", ',', &aor))
+			continue;
+
+		fmt_param_sep_get(&pl, "scode",   ',', &params.scode);
+		fmt_param_sep_get(&pl, "contact", ',', &params.contact);
+		fmt_param_sep_get(&pl, "params",  ',', &params.divparams);
+		fmt_param_sep_get(&pl, "reason",  ',', &params.reason);
+		while (params.reason.l &&
+		       (params.reason.p[params.reason.l - 1] == '\n' ||
+			params.reason.p[params.reason.l - 1] == '\r'))
+			--params.reason.l;
+
+		if (fmt_param_sep_get(&pl, "expires_at", ',', &v))
+			expat = pl_u64(&v);
+
+		if (expat) {
+			uint64_t now = (uint64_t)time(NULL);
+
+			if (expat <= now)
+				continue;
+
+			params.expires = (uint32_t)(expat - now);
+		}
+
+		if (pl_strdup(&aorstr, &aor))
+			continue;
+
+		ua = uag_find_aor(aorstr);
+		aorstr = mem_deref(aorstr);
+		if (!ua)
+			continue;
+
+		if (0 == redirect_add(ua, &params))
+			++n;
+	}
+
+	(void)fclose(f);
+
+	if (n)
+		info("redirect: restored %u redirections\n", n);
+}
+
+
 static int cmd_redir_add(struct re_printf *pf, void *arg)
 {
 	const struct cmd_arg *carg = arg;
@@ -262,36 +442,18 @@ static int cmd_redir_add(struct re_printf *pf, void *arg)
 		return EINVAL;
 	}
 
-	struct redirect *r;
+	struct redir_params params = { 0 };
 	int err;
 
-	ua_redir_clear(ua);
-	r = mem_zalloc(sizeof(*r), redirect_destructor);
-	r->ua = ua;
-	tmr_init(&r->tmr);
-
-	struct redir_params params = { 0 };
 	redirect_parse(&params, carg);
-	r->scode = pl_isset(&params.scode) ? pl_u32(&params.scode) : 302;
-
-	if (pl_isset(&params.reason))
-		err = pl_strdup(&r->reason, &params.reason);
-	else
-		err = str_dup(&r->reason, "Moved Temporarily");
-
-	if (pl_isset(&params.contact))
-		err = pl_strdup(&r->contact, &params.contact);
-
-	if (params.expires)
-		tmr_start(&r->tmr, params.expires*1000, redirect_expired, r);
-
-	if (pl_isset(&params.divparams))
-		err = pl_strdup(&r->divparams, &params.divparams);
+	err = redirect_add(ua, &params);
+	if (err)
+		return err;
 
-	list_append(&d.redirs, &r->le, r);
+	store_save();
 	re_hprintf(pf, "redirect: added redirection\n");
 	list_apply(&d.redirs, true, redirect_debug, pf);
-	return err;
+	return 0;
 }
 
 
@@ -307,6 +469,7 @@ static int cmd_redir_rm(struct re_printf *pf, void *arg)
 	}
 
 	ua_redir_clear(ua);
+	store_save();
 	re_hprintf(pf, "redirect: removed redirection of %s\n",
 		   account_aor(ua_account(ua)));
 	list_apply(&d.redirs, true, redirect_debug, pf);
@@ -438,15 +601,32 @@ static const struct cmd cmdv[] = {
 };
 
 
+static void load_handler(void *arg)
+{
+	(void)arg;
+
+	store_load();
+}
+
+
 static int module_init(void)
 {
+	char path[256];
 	int err;
 
-	err  = bevent_register(event_handler, NULL);
+	err  = hash_alloc(&d.redhash, 32);
+	err |= bevent_register(event_handler, NULL);
 	err |= cmd_register(baresip_commands(), cmdv, RE_ARRAY_SIZE(cmdv));
 	if (err)
 		return err;
 
+	if (0 == conf_path_get(path, sizeof(path)))
+		re_snprintf(store_path, sizeof(store_path),
+			    "%s/redirect_store", path);
+
+	/* reload deferred until all accounts are loaded */
+	tmr_start(&load_tmr, 0, load_handler, NULL);
+
 	info("redirect: module loaded\n");
 	return 0;
 }
@@ -454,9 +634,11 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	tmr_cancel(&load_tmr);
 	bevent_unregister(event_handler);
 	cmd_unregister(baresip_commands(), cmdv);
 	list_flush(&d.redirs);
+	d.redhash = mem_deref(d.redhash);
 	return 0;
 }
 
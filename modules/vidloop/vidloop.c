@@ -8,6 +8,7 @@
 #include <string.h>
 #include <time.h>
 #include <re.h>
+#include <re_atomic.h>
 #include <rem.h>
 #include <baresip.h>
 
@@ -20,6 +21,10 @@
  * Simple test module that loops back the video frames from a
  * video-source to a video-display, optionally via a video codec.
  *
+ * Encode and decode run on separate worker threads connected by
+ * bounded frame queues, so the loop can use multiple cores. The
+ * summary reports the busy time per pipeline stage.
+ *
  * Example usage without codec:
  \verbatim
   baresip -e/vidloop
@@ -33,7 +38,9 @@
 
 
 enum {
-	VIDEO_SRATE = 90000
+	VIDEO_SRATE = 90000,
+	QUEUE_DEPTH = 4,       /* max frames queued per pipeline stage */
+	POOL_FRAMES = 3        /* recycled frames per pipeline stage   */
 };
 
 
@@ -55,6 +62,47 @@ struct timestamp_state {
 };
 
 
+struct video_loop;
+
+/** Entry in a bounded pipeline queue */
+struct pipe_ent {
+	struct le le;
+	struct vidframe *frame;   /* encode stage */
+	uint64_t timestamp;
+	struct mbuf *mb;          /* decode stage */
+	bool marker;
+	uint64_t rtp_ts;
+};
+
+typedef void (pipe_work_h)(struct video_loop *vl, struct pipe_ent *ent);
+
+/** Pool of recycled video frames, sized on first use */
+struct frame_pool {
+	mtx_t lock;
+	struct list framel;       /* struct frame_ent */
+	size_t count;
+};
+
+struct frame_ent {
+	struct le le;
+	struct vidframe *frame;
+};
+
+/** Pipeline stage with worker thread and bounded queue */
+struct pipework {
+	struct video_loop *vl;
+	pipe_work_h *workh;
+	thrd_t tid;
+	mtx_t lock;
+	cnd_t cond;
+	struct list queue;
+	size_t count;
+	bool run;
+	bool started;
+	uint64_t n_drop;
+};
+
+
 /** Video loop */
 struct video_loop {
 	const struct vidcodec *vc_enc;
@@ -88,11 +136,24 @@ struct video_loop {
 	bool started;
 	int err;
 
+	struct pipework enc_work;
+	struct pipework dec_work;
+
+	struct frame_pool pool_src;
+	struct frame_pool pool_conv;
+	struct frame_pool pool_disp;
+
 	struct {
 		uint64_t src_frames;
 		uint64_t enc_bytes;
 		uint64_t enc_packets;
 		uint64_t disp_frames;
+
+		/* busy time per pipeline stage */
+		RE_ATOMIC uint64_t conv_us;
+		RE_ATOMIC uint64_t enc_us;
+		RE_ATOMIC uint64_t dec_us;
+		RE_ATOMIC uint64_t disp_us;
 	} stats;
 
 	struct timestamp_state ts_src;
@@ -146,6 +207,215 @@ static void vidframe_clear(struct vidframe *frame)
 }
 
 
+static void frame_ent_destructor(void *arg)
+{
+	struct frame_ent *ent = arg;
+
+	list_unlink(&ent->le);
+	mem_deref(ent->frame);
+}
+
+
+static int pool_init(struct frame_pool *pool)
+{
+	return mtx_init(&pool->lock, mtx_plain) != thrd_success ? ENOMEM : 0;
+}
+
+
+static void pool_flush(struct frame_pool *pool)
+{
+	mtx_lock(&pool->lock);
+	list_flush(&pool->framel);
+	pool->count = 0;
+	mtx_unlock(&pool->lock);
+}
+
+
+/**
+ * Get a video frame from the pool
+ *
+ * A pooled frame is free again once all references are dropped. If
+ * every pooled frame is still held downstream (e.g. by the display
+ * across ticks) a transient frame is allocated as fallback.
+ *
+ * @param pool Frame pool
+ * @param fmt  Wanted pixel format
+ * @param sz   Wanted frame size
+ *
+ * @return Referenced video frame, or NULL on error
+ */
+static struct vidframe *pool_get(struct frame_pool *pool, enum vidfmt fmt,
+				 const struct vidsz *sz)
+{
+	struct vidframe *frame = NULL;
+	struct frame_ent *ent;
+	struct le *le;
+
+	mtx_lock(&pool->lock);
+
+	/* free frame with matching geometry */
+	LIST_FOREACH(&pool->framel, le) {
+		ent = le->data;
+
+		if (mem_nrefs(ent->frame) > 1)
+			continue;
+
+		if (ent->frame->fmt == fmt &&
+		    vidsz_cmp(&ent->frame->size, sz)) {
+			frame = mem_ref(ent->frame);
+			goto out;
+		}
+	}
+
+	/* free frame with stale geometry: re-allocate in place */
+	LIST_FOREACH(&pool->framel, le) {
+		struct vidframe *nf;
+
+		ent = le->data;
+
+		if (mem_nrefs(ent->frame) > 1)
+			continue;
+
+		if (vidframe_alloc(&nf, fmt, sz))
+			break;
+
+		mem_deref(ent->frame);
+		ent->frame = nf;
+		frame = mem_ref(nf);
+		goto out;
+	}
+
+	/* grow the pool up to its fixed size */
+	if (pool->count < POOL_FRAMES) {
+
+		ent = mem_zalloc(sizeof(*ent), frame_ent_destructor);
+		if (!ent)
+			goto out;
+
+		if (vidframe_alloc(&ent->frame, fmt, sz)) {
+			mem_deref(ent);
+			goto out;
+		}
+
+		list_append(&pool->framel, &ent->le, ent);
+		++pool->count;
+		frame = mem_ref(ent->frame);
+		goto out;
+	}
+
+	/* all pooled frames busy: transient fallback */
+	(void)vidframe_alloc(&frame, fmt, sz);
+
+ out:
+	mtx_unlock(&pool->lock);
+
+	return frame;
+}
+
+
+static void pipe_ent_destructor(void *arg)
+{
+	struct pipe_ent *ent = arg;
+
+	list_unlink(&ent->le);
+	mem_deref(ent->frame);
+	mem_deref(ent->mb);
+}
+
+
+/* hand an entry to a pipeline stage; drops the entry if the bounded
+ * queue is full so a slow stage cannot stall its producer */
+static void pipework_push(struct pipework *pw, struct pipe_ent *ent)
+{
+	mtx_lock(&pw->lock);
+
+	if (pw->count >= QUEUE_DEPTH) {
+		++pw->n_drop;
+		mtx_unlock(&pw->lock);
+		mem_deref(ent);
+		return;
+	}
+
+	list_append(&pw->queue, &ent->le, ent);
+	++pw->count;
+	cnd_signal(&pw->cond);
+
+	mtx_unlock(&pw->lock);
+}
+
+
+static int pipework_thread(void *arg)
+{
+	struct pipework *pw = arg;
+
+	for (;;) {
+		struct pipe_ent *ent;
+
+		mtx_lock(&pw->lock);
+		while (pw->run && !pw->queue.head)
+			cnd_wait(&pw->cond, &pw->lock);
+
+		if (!pw->run) {
+			mtx_unlock(&pw->lock);
+			break;
+		}
+
+		ent = pw->queue.head->data;
+		list_unlink(&ent->le);
+		--pw->count;
+		mtx_unlock(&pw->lock);
+
+		pw->workh(pw->vl, ent);
+		mem_deref(ent);
+	}
+
+	return 0;
+}
+
+
+static int pipework_start(struct pipework *pw, struct video_loop *vl,
+			  const char *name, pipe_work_h *workh)
+{
+	int err;
+
+	pw->vl    = vl;
+	pw->workh = workh;
+
+	err  = mtx_init(&pw->lock, mtx_plain) != thrd_success;
+	err |= cnd_init(&pw->cond) != thrd_success;
+	if (err)
+		return ENOMEM;
+
+	pw->run = true;
+	err = thread_create_name(&pw->tid, name, pipework_thread, pw);
+	if (err) {
+		pw->run = false;
+		return err;
+	}
+
+	pw->started = true;
+
+	return 0;
+}
+
+
+static void pipework_stop(struct pipework *pw)
+{
+	if (!pw->started)
+		return;
+
+	mtx_lock(&pw->lock);
+	pw->run = false;
+	cnd_signal(&pw->cond);
+	mtx_unlock(&pw->lock);
+
+	thrd_join(pw->tid, NULL);
+	list_flush(&pw->queue);
+	pw->count = 0;
+	pw->started = false;
+}
+
+
 static void display_handler(void *arg)
 {
 	struct video_loop *vl = arg;
@@ -175,29 +445,36 @@ static void display_handler(void *arg)
 }
 
 
+/*
+ * Hand a frame over to the display timer. A refframe is a pooled,
+ * reference-counted frame that is passed on by reference; other frames
+ * (e.g. owned by the decoder) are copied once into a pooled frame.
+ */
 static int display(struct video_loop *vl, struct vidframe *frame,
-		   uint64_t timestamp)
+		   uint64_t timestamp, bool refframe)
 {
-	struct vidframe *frame_filt = NULL;
 	struct le *le;
+	bool owned = false;
 	int err = 0;
 
 	if (!vidframe_isvalid(frame))
 		return 0;
 
-	if (!list_isempty(&vl->filtdecl)) {
+	if (!list_isempty(&vl->filtdecl) && !refframe) {
 
 		/* Some video decoders keeps the displayed video frame
 		 * in memory and we should not write to that frame.
 		 */
+		struct vidframe *f2 = pool_get(&vl->pool_disp, frame->fmt,
+					       &frame->size);
+		if (!f2)
+			return ENOMEM;
 
-		err = vidframe_alloc(&frame_filt, frame->fmt, &frame->size);
-		if (err)
-			return err;
-
-		vidframe_copy(frame_filt, frame);
+		vidframe_copy(f2, frame);
 
-		frame = frame_filt;
+		frame = f2;
+		refframe = true;
+		owned = true;
 	}
 
 	/* Process video frame through all Video Filters */
@@ -217,44 +494,84 @@ static int display(struct video_loop *vl, struct vidframe *frame,
 	vl->disp_size = frame->size;
 	vl->disp_fmt = frame->fmt;
 
+	const uint64_t t0 = tmr_jiffies_usec();
+
+	if (refframe) {
+		/* the pool reference taken above is handed over as is */
+		if (!owned)
+			mem_ref(frame);
+	}
+	else {
+		/* decoder-owned frame: copy once into a pooled frame */
+		struct vidframe *f2 = pool_get(&vl->pool_disp, frame->fmt,
+					       &frame->size);
+		if (!f2)
+			return ENOMEM;
+
+		vidframe_copy(f2, frame);
+		frame = f2;
+	}
+
 	mtx_lock(vl->frame_mutex);
 
 	if (vl->frame && ! vidsz_cmp(&vl->frame->size, &frame->size)) {
 
 		info("vidloop: resolution changed:  %u x %u\n",
 		     frame->size.w, frame->size.h);
-
-		vl->frame = mem_deref(vl->frame);
-	}
-
-	if (!vl->frame) {
-		err = vidframe_alloc(&vl->frame, frame->fmt, &frame->size);
-		if (err)
-			goto out;
 	}
 
-	vidframe_copy(vl->frame, frame);
+	mem_deref(vl->frame);
+	vl->frame = frame;      /* pass by reference, no copy */
 	vl->frame_timestamp = timestamp;
 	vl->new_frame = true;
 
- out:
 	mtx_unlock(vl->frame_mutex);
 
-	mem_deref(frame_filt);
+	re_atomic_rlx_add(&vl->stats.disp_us, tmr_jiffies_usec() - t0);
 
 	return err;
 }
 
 
+static void decode_work(struct video_loop *vl, struct pipe_ent *ent)
+{
+	struct vidframe frame;
+	struct rtp_header rtp_hdr = {.m = ent->marker, .seq = vl->seq++};
+	struct viddec_packet pkt  = {.mb = ent->mb, .hdr = &rtp_hdr};
+	const uint64_t t0 = tmr_jiffies_usec();
+	int err;
+
+	/* convert the RTP timestamp to VIDEO_TIMEBASE timestamp */
+	pkt.timestamp = video_calc_timebase_timestamp(ent->rtp_ts);
+
+	/* decode */
+	vidframe_clear(&frame);
+	if (vl->vc_dec && vl->dec) {
+		err = vl->vc_dec->dech(vl->dec, &frame, &pkt);
+		if (err) {
+			warning("vidloop: codec decode: %m\n", err);
+			return;
+		}
+
+		if (pkt.intra)
+			++vl->stat.n_keyframe;
+	}
+
+	re_atomic_rlx_add(&vl->stats.dec_us, tmr_jiffies_usec() - t0);
+
+	if (vidframe_isvalid(&frame))
+		display(vl, &frame, pkt.timestamp, false);
+}
+
+
 static int packet_handler(bool marker, uint64_t rtp_ts,
 			  const uint8_t *hdr, size_t hdr_len,
 			  const uint8_t *pld, size_t pld_len,
 			  const struct video *arg)
 {
 	struct video_loop *vl = (struct video_loop*)arg;
-	struct vidframe frame;
+	struct pipe_ent *ent;
 	struct mbuf *mb;
-	int err = 0;
 
 	++vl->stats.enc_packets;
 	vl->stats.enc_bytes += (hdr_len + pld_len);
@@ -273,30 +590,17 @@ static int packet_handler(bool marker, uint64_t rtp_ts,
 
 	vl->stat.bytes += mbuf_get_left(mb);
 
-	struct rtp_header rtp_hdr = {.m = marker, .seq = vl->seq++};
-	struct viddec_packet pkt  = {.mb = mb, .hdr = &rtp_hdr};
-
-	/* convert the RTP timestamp to VIDEO_TIMEBASE timestamp */
-	pkt.timestamp = video_calc_timebase_timestamp(rtp_ts);
-
-	/* decode */
-	vidframe_clear(&frame);
-	if (vl->vc_dec && vl->dec) {
-		err = vl->vc_dec->dech(vl->dec, &frame, &pkt);
-		if (err) {
-			warning("vidloop: codec decode: %m\n", err);
-			goto out;
-		}
-
-		if (pkt.intra)
-			++vl->stat.n_keyframe;
+	ent = mem_zalloc(sizeof(*ent), pipe_ent_destructor);
+	if (!ent) {
+		mem_deref(mb);
+		return ENOMEM;
 	}
 
-	if (vidframe_isvalid(&frame))
-		display(vl, &frame, pkt.timestamp);
+	ent->mb     = mb;
+	ent->marker = marker;
+	ent->rtp_ts = rtp_ts;
 
- out:
-	mem_deref(mb);
+	pipework_push(&vl->dec_work, ent);
 
 	return 0;
 }
@@ -314,28 +618,16 @@ static int packet_handler_h264(bool marker, uint64_t rtp_ts,
 }
 
 
-static void vidsrc_frame_handler(struct vidframe *frame, uint64_t timestamp,
-				 void *arg)
+static void encode_work(struct video_loop *vl, struct pipe_ent *ent)
 {
-	struct video_loop *vl = arg;
+	struct vidframe *frame = ent->frame;
 	struct vidframe *f2 = NULL;
+	uint64_t timestamp = ent->timestamp;
 	struct le *le;
-	const uint64_t now = tmr_jiffies_usec();
+	uint64_t t0, t1;
 	int err = 0;
 
-	/* save the timing info */
-	if (!gvl->ts_start)
-		gvl->ts_start = now;
-	gvl->ts_last = now;
-
-	/* save the video frame info */
-	vl->src_size = frame->size;
-	vl->src_fmt = frame->fmt;
-	++vl->stats.src_frames;
-
-	timestamp_state_update(&vl->ts_src, timestamp);
-
-	++vl->stat.frames;
+	t0 = tmr_jiffies_usec();
 
 	if (frame->fmt != (enum vidfmt)vl->cfg.enc_fmt) {
 
@@ -347,7 +639,9 @@ static void vidsrc_frame_handler(struct vidframe *frame, uint64_t timestamp,
 			vl->need_conv = true;
 		}
 
-		if (vidframe_alloc(&f2, vl->cfg.enc_fmt, &frame->size))
+		f2 = pool_get(&vl->pool_conv, vl->cfg.enc_fmt,
+			      &frame->size);
+		if (!f2)
 			return;
 
 		vidconv(f2, frame, 0);
@@ -355,6 +649,9 @@ static void vidsrc_frame_handler(struct vidframe *frame, uint64_t timestamp,
 		frame = f2;
 	}
 
+	t1 = tmr_jiffies_usec();
+	re_atomic_rlx_add(&vl->stats.conv_us, t1 - t0);
+
 	/* Process video frame through all Video Filters */
 	for (le = vl->filtencl.head; le; le = le->next) {
 
@@ -371,10 +668,15 @@ static void vidsrc_frame_handler(struct vidframe *frame, uint64_t timestamp,
 			warning("vidloop: encoder error (%m)\n", err);
 			goto out;
 		}
+
+		re_atomic_rlx_add(&vl->stats.enc_us,
+				  tmr_jiffies_usec() - t1);
 	}
 	else {
+		re_atomic_rlx_add(&vl->stats.enc_us,
+				  tmr_jiffies_usec() - t1);
 		vl->stat.bytes += vidframe_size(frame->fmt, &frame->size);
-		(void)display(vl, frame, timestamp);
+		(void)display(vl, frame, timestamp, true);
 	}
 
  out:
@@ -382,6 +684,45 @@ static void vidsrc_frame_handler(struct vidframe *frame, uint64_t timestamp,
 }
 
 
+static void vidsrc_frame_handler(struct vidframe *frame, uint64_t timestamp,
+				 void *arg)
+{
+	struct video_loop *vl = arg;
+	struct pipe_ent *ent;
+	const uint64_t now = tmr_jiffies_usec();
+
+	/* save the timing info */
+	if (!gvl->ts_start)
+		gvl->ts_start = now;
+	gvl->ts_last = now;
+
+	/* save the video frame info */
+	vl->src_size = frame->size;
+	vl->src_fmt = frame->fmt;
+	++vl->stats.src_frames;
+
+	timestamp_state_update(&vl->ts_src, timestamp);
+
+	++vl->stat.frames;
+
+	/* hand the frame to the encode stage */
+	ent = mem_zalloc(sizeof(*ent), pipe_ent_destructor);
+	if (!ent)
+		return;
+
+	ent->frame = pool_get(&vl->pool_src, frame->fmt, &frame->size);
+	if (!ent->frame) {
+		mem_deref(ent);
+		return;
+	}
+
+	vidframe_copy(ent->frame, frame);
+	ent->timestamp = timestamp;
+
+	pipework_push(&vl->enc_work, ent);
+}
+
+
 static void vidsrc_packet_handler(struct vidpacket *packet, void *arg)
 {
 	struct video_loop *vl = arg;
@@ -500,6 +841,35 @@ static int print_stats(struct re_printf *pf, const struct video_loop *vl)
 				  vl->stat.n_keyframe);
 	}
 
+	/* Pipeline */
+	if (vl->stats.src_frames) {
+
+		const uint64_t n_frames = vl->stats.src_frames;
+		const uint64_t n_pkt = vl->stats.enc_packets;
+		const uint64_t n_disp = vl->stats.disp_frames;
+
+		err |= re_hprintf(pf,
+				  "* Pipeline\n"
+				  "  conv        %.1f us/frame\n"
+				  "  encode      %.1f us/frame"
+				  "  (queue drops %llu)\n"
+				  "  decode      %.1f us/packet"
+				  "  (queue drops %llu)\n"
+				  "  display     %.1f us/frame\n"
+				  "\n"
+				  ,
+				  (double)re_atomic_rlx(&vl->stats.conv_us) /
+					(double)n_frames,
+				  (double)re_atomic_rlx(&vl->stats.enc_us) /
+					(double)n_frames,
+				  vl->enc_work.n_drop,
+				  (double)re_atomic_rlx(&vl->stats.dec_us) /
+					(double)(n_pkt ? n_pkt : 1),
+				  vl->dec_work.n_drop,
+				  (double)re_atomic_rlx(&vl->stats.disp_us) /
+					(double)(n_disp ? n_disp : 1));
+	}
+
 	/* Display */
 	if (vl->vidisp) {
 		const struct vidisp *vd = vl->vd;
@@ -531,6 +901,11 @@ static void vidloop_destructor(void *arg)
 
 	tmr_cancel(&vl->tmr_bw);
 	mem_deref(vl->vsrc);
+
+	/* stop workers before the codec states go away */
+	pipework_stop(&vl->enc_work);
+	pipework_stop(&vl->dec_work);
+
 	mem_deref(vl->enc);
 	mem_deref(vl->dec);
 	tmr_cancel(&vl->tmr_update_src);
@@ -543,6 +918,11 @@ static void vidloop_destructor(void *arg)
 
 	list_flush(&vl->filtencl);
 	list_flush(&vl->filtdecl);
+
+	pool_flush(&vl->pool_src);
+	pool_flush(&vl->pool_conv);
+	pool_flush(&vl->pool_disp);
+
 	mem_deref(vl->frame_mutex);
 }
 
@@ -607,12 +987,19 @@ static void print_status(struct video_loop *vl)
 {
 	re_printf("\rstatus:"
 		  " %.3f sec [%s] [%s]  fmt=%s "
-		  " EFPS=%.1f      %u kbit/s",
+		  " EFPS=%.1f      %u kbit/s"
+		  "  enc=%.0fus dec=%.0fus",
 		  timestamp_state_duration(&vl->ts_src, VIDEO_TIMEBASE),
 		  vl->vc_enc ? vl->vc_enc->name : "",
 		  vl->vc_dec ? vl->vc_dec->name : "",
 		  vidfmt_name(vl->cfg.enc_fmt),
-		  vl->stat.efps, vl->stat.bitrate);
+		  vl->stat.efps, vl->stat.bitrate,
+		  (double)re_atomic_rlx(&vl->stats.enc_us) /
+			(double)(vl->stats.src_frames ?
+				 vl->stats.src_frames : 1),
+		  (double)re_atomic_rlx(&vl->stats.dec_us) /
+			(double)(vl->stats.enc_packets ?
+				 vl->stats.enc_packets : 1));
 
 	if (vl->enc || vl->dec)
 		re_printf("  key-frames=%zu", vl->stat.n_keyframe);
@@ -745,6 +1132,17 @@ static int video_loop_alloc(struct video_loop **vlp)
 	vl->new_frame = false;
 	vl->frame = NULL;
 
+	err  = pool_init(&vl->pool_src);
+	err |= pool_init(&vl->pool_conv);
+	err |= pool_init(&vl->pool_disp);
+	if (err)
+		goto out;
+
+	err  = pipework_start(&vl->enc_work, vl, "vlenc", encode_work);
+	err |= pipework_start(&vl->dec_work, vl, "vldec", decode_work);
+	if (err)
+		goto out;
+
 	/* Video filters */
 	for (le = list_head(baresip_vidfiltl()); le; le = le->next) {
 		struct vidfilt *vf = le->data;